@@ -0,0 +1,194 @@
+// Optional per-thread instrumentation of the hot loops of primes,
+// sum and insertion.
+//
+// Compile with -DINSTRUMENT (e.g. make clean all CFLAGS="-O3
+// -DINSTRUMENT") to turn it on.  Each thread then records, in its own
+// ThreadProfile:
+//  - how long it was busy, between profile_begin() and profile_end()
+//  - how many units of work it did (slices, blocks or words)
+//  - how often it took a mutex, how often the mutex was already
+//    taken, and how long it waited for it
+//  - cycles, instructions, last-level cache misses and branch misses,
+//    from perf_event_open(), if the kernel lets us (see
+//    /proc/sys/kernel/perf_event_paranoid)
+// and profile_report() prints them after the join, with how unevenly
+// the work was spread.
+//
+// Without INSTRUMENT, every function here is an empty inline one,
+// except profile_lock(), which only locks the mutex, so the hot loops
+// compile to what they were without it.
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef INSTRUMENT
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+const int profileCounters = 4;
+const char *const profileCounterNames[profileCounters] = { "cycles", "instr", "LLC miss", "br miss" };
+
+// Each thread writes its own, so each one gets its own cache line
+struct alignas(64) ThreadProfile
+{
+  double busy;          // seconds of work, summed over begin/end pairs
+  uint64_t units;       // slices, blocks or words done
+  uint64_t locks;       // mutexes taken with profile_lock()
+  uint64_t contended;   // ... that were already taken
+  double lockWait;      // seconds spent waiting for them
+  uint64_t counters[profileCounters];  // see profileCounterNames
+  bool hasCounters;     // false if perf_event_open() was refused
+  double start;         // when profile_begin() was called
+  int fds[profileCounters];  // perf event group of this thread, leader first
+};
+
+
+#ifdef INSTRUMENT
+
+static inline double profile_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Start counting for the calling thread.  The four counters are
+// opened as one group, so that they count over exactly the same
+// instructions; this costs a few system calls, so it is done once per
+// piece of work, not once per unit.
+static inline void profile_begin(ThreadProfile *p)
+{
+  static const uint64_t events[profileCounters] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  for( int k = 0; k < profileCounters; k++ ) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = events[k];
+    attr.disabled = k == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    p->fds[k] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, k ? p->fds[0] : -1, 0);
+    if( p->fds[k] < 0 ) {
+      for( int j = 0; j < k; j++ ) {
+        close(p->fds[j]);
+      }
+      p->fds[0] = -1;
+      break;
+    }
+  }
+  if( p->fds[0] >= 0 ) {
+    ioctl(p->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(p->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  p->start = profile_now();
+}
+
+static inline void profile_end(ThreadProfile *p)
+{
+  p->busy += profile_now() - p->start;
+  if( p->fds[0] < 0 ) {
+    return;
+  }
+  ioctl(p->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  uint64_t values[1 + profileCounters];  // nr, then one value per counter
+  if( read(p->fds[0], values, sizeof(values)) == (ssize_t) sizeof(values) ) {
+    for( int k = 0; k < profileCounters; k++ ) {
+      p->counters[k] += values[1 + k];
+    }
+    p->hasCounters = true;
+  }
+  for( int k = 0; k < profileCounters; k++ ) {
+    close(p->fds[k]);
+  }
+}
+
+static inline void profile_units(ThreadProfile *p, uint64_t n)
+{
+  p->units += n;
+}
+
+// Lock m, and return true if some other thread held it.  The clock
+// is only read when it was held, so an uncontended lock costs the
+// same as before.
+static inline bool profile_lock(ThreadProfile *p, pthread_mutex_t *m)
+{
+  p->locks++;
+  if( pthread_mutex_trylock(m) == 0 ) {
+    return false;
+  }
+  double t = profile_now();
+  pthread_mutex_lock(m);
+  p->lockWait += profile_now() - t;
+  p->contended++;
+  return true;
+}
+
+// Print the profiles of n threads to stderr, and how unevenly the
+// work was spread: the slowest thread's busy time over the average
+// (1.00 is perfect balance; everybody waits for the slowest at the
+// join), and the share of the busy time spent waiting for locks.
+static inline void profile_report(const char *what, const ThreadProfile *p, int n)
+{
+  fprintf(stderr, "%s, per thread:\n", what);
+  fprintf(stderr, "thread  busy ms      units    locks  contended  wait ms");
+  for( int k = 0; k < profileCounters; k++ ) {
+    fprintf(stderr, " %12s", profileCounterNames[k]);
+  }
+  fprintf(stderr, "    IPC\n");
+
+  double total = 0, longest = 0, wait = 0;
+  for( int i = 0; i < n; i++ ) {
+    fprintf(stderr, "%6d %8.2f %10llu %8llu %10llu %8.2f", i, p[i].busy * 1e3,
+            (unsigned long long) p[i].units, (unsigned long long) p[i].locks,
+            (unsigned long long) p[i].contended, p[i].lockWait * 1e3);
+    if( p[i].hasCounters ) {
+      for( int k = 0; k < profileCounters; k++ ) {
+        fprintf(stderr, " %12llu", (unsigned long long) p[i].counters[k]);
+      }
+      fprintf(stderr, " %6.2f\n", p[i].counters[0] ? (double) p[i].counters[1] / (double) p[i].counters[0] : 0);
+    } else {
+      fprintf(stderr, "  (no hardware counters)\n");
+    }
+    total += p[i].busy;
+    longest = p[i].busy > longest ? p[i].busy : longest;
+    wait += p[i].lockWait;
+  }
+  if( total > 0 ) {
+    fprintf(stderr, "imbalance (slowest / average busy time): %.2f, waiting for locks: %.1f%% of busy time\n",
+            longest / (total / n), 100 * wait / total);
+  }
+}
+
+#else
+
+static inline void profile_begin(ThreadProfile *) {}
+static inline void profile_end(ThreadProfile *) {}
+static inline void profile_units(ThreadProfile *, uint64_t) {}
+static inline void profile_report(const char *, const ThreadProfile *, int) {}
+
+static inline bool profile_lock(ThreadProfile *, pthread_mutex_t *m)
+{
+  if( pthread_mutex_trylock(m) == 0 ) {
+    return false;
+  }
+  pthread_mutex_lock(m);
+  return true;
+}
+
+#endif
+
+#endif
@@ -2,88 +2,1606 @@
 // g++ -Wall -Wextra -Wconversion -O3 insertion.cpp -o insertion -lpthread
 
 #include <assert.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
 #include <list>
+#include <queue>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "../instrument.h"
 
 using namespace std;
 
+// How the threads' words end up in one sorted list.
+//  - LIST: every thread appends its words to the global wordList,
+//    taking counter_mutex once per batch of listBatch words (see
+//    insert_batch()), and main() sorts the list when they are done.
+//  - SHARDED: every thread copies its words into its own shard and
+//    sorts it, without any lock.  Then the sorted shards are merged
+//    in parallel (see merge_shards()).
+//  - RADIX: every thread copies its words into its own shard, and
+//    then all the words are sorted at once by a parallel radix sort
+//    on their first 8 bytes (see radix_sort_words()).
+//  - COUNT: every thread copies its words into its own shard, and
+//    then adds them to one shared hash table of (word, count), so
+//    each distinct word is kept once (see count_shard()).  Only the
+//    distinct words are sorted, by word or by count.
+//  - PIPELINE: the threads hand batches of words through a bounded
+//    queue to as many sorting threads, which sort them into runs and
+//    merge the runs while words are still coming in (see consume()).
+enum Mode { LIST, SHARDED, RADIX, COUNT, PIPELINE };
+const char *modeNames[] = { "list", "sharded", "radix", "count", "pipeline" };
+
 // global variables
 
 list<string> wordList;
-const int numWords = 5;  // each array contains 5 words
+int numWords = 5;  // each array contains 5 words
 
 // TODO: declare a mutex here
 pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// LIST mode: how many words a thread gathers in its own list before
+// moving them to wordList, under one lock (see insert_batch())
+size_t listBatch = 1024;
+
+// true: measure how long the threads wait for counter_mutex and hold
+// it (two clock reads per lock, so only for lock_benchmark())
+bool timeLocks = false;
+
+Mode mode = RADIX;
+
+// A word in a Shard: its bytes are shard.bytes[offset .. offset+length)
+struct WordRef
+{
+  uint64_t offset;
+  uint32_t length;
+};
+
+// The words collected by one thread (SHARDED and RADIX modes).
+//
+// A std::string longer than 15 characters (like "discrepancies" +
+// 3 more) allocates its bytes on the heap, and every list node is
+// one more allocation, so with millions of words the threads spend
+// much of their time in malloc, often waiting on each other.  A
+// Shard instead copies the bytes of all its words one after the
+// other into one big buffer, its "arena": adding a word is a memcpy
+// and a bump of `used`.  The arena may move when it grows, so words
+// are kept as (offset, length); word() turns them into string_views
+// once the thread is done adding.  All the memory is freed at once,
+// by release().
+//
+// When the words come from a file (see map_file()), they are not
+// copied at all: `bytes` points to the whole file, the arena is not
+// used, and add_ref() just records where each word is in the file.
+struct Shard
+{
+  char *arena;
+  size_t used;
+  size_t capacity;
+  const char *bytes;          // what the offsets are relative to: arena, or the file
+  vector<WordRef> refs;
+  vector<string_view> views;  // SHARDED mode: the words, sorted
+
+  Shard() : arena(0), used(0), capacity(0), bytes(0) {}
+
+  void reserve(size_t n)
+  {
+    if (n > capacity) {
+      capacity = max(n, 2 * capacity);
+      arena = (char *) realloc(arena, capacity);
+      assert(arena);
+      bytes = arena;
+    }
+  }
+
+  void add(const char *word, size_t length)
+  {
+    reserve(used + length);
+    memcpy(arena + used, word, length);
+    add_ref(used, length);
+    used += length;
+  }
+
+  void add_ref(size_t offset, size_t length)
+  {
+    assert(length <= UINT32_MAX);
+    WordRef ref = { offset, (uint32_t) length };
+    refs.push_back(ref);
+  }
+
+  size_t size() const
+  {
+    return refs.size();
+  }
+
+  string_view word(size_t i) const
+  {
+    return string_view(bytes + refs[i].offset, refs[i].length);
+  }
+
+  void release()
+  {
+    free(arena);
+    arena = 0;
+    bytes = 0;
+    used = capacity = 0;
+    refs = vector<WordRef>();
+    views = vector<string_view>();
+  }
+};
+
+// SHARDED and RADIX modes: shards[i] holds the words of thread i.
+// Each thread only ever touches its own shard, so no mutex is needed.
+// (PIPELINE mode only uses the views, for sorting thread i's run.)
+vector<Shard> shards;
+
+// SHARDED, RADIX and PIPELINE modes: the sorted result.  The views
+// point into the shards' arenas (or the input words, in PIPELINE mode).
+vector<string_view> sortedWords;
+
+// COUNT mode: the distinct words and how often each one was added
+struct WordCount
+{
+  string_view word;
+  uint64_t count;
+};
+vector<WordCount> wordCounts;
+
+// COUNT mode: sort wordCounts by decreasing count instead of by word,
+// and keep only the first topK of them (0: all)
+bool byFrequency = false;
+size_t topK = 0;
+
+// false: don't print "Thread created." etc. (for benchmark())
+bool verbose = true;
+
+
+// The input file (see map_file()), if any
+const char *fileText = 0;
+size_t fileSize = 0;
+
+
+// How one thread used counter_mutex
+struct LockStats
+{
+  uint64_t locks;      // times it took the lock
+  uint64_t contended;  // ... and found it already taken
+  double wait;         // seconds spent waiting for it (if timeLocks)
+  double hold;         // seconds spent holding it (if timeLocks)
+};
+
+// What one insert() thread has to do: add the numWords strings at
+// words, or if words is 0, the words in fileText[begin .. end)
+struct InsertJob
+{
+  int id;              // index of this thread's shard
+  const string *words; // the numWords words to add
+  size_t begin;
+  size_t end;
+  LockStats stats;     // LIST mode
+  ThreadProfile *profile; // see instrument.h
+};
+
 
 void * insert(void *);
+void insert_batch(list<string> &batch, InsertJob *job);
+void free_shards();
+void merge_shards(int TN);
+void radix_sort_words(int TN);
+void count_shard(size_t t);
+void sort_counts();
+void produce(const InsertJob *job);
+void * consume(void *);
+void start_pipeline(int TN);
+
 
-int main()
+// Print the words in [begin, end), which should be in sorted order.
+// Long lists are only checked, not printed.
+template <typename Iterator>
+void print_words(Iterator begin, Iterator end)
 {
+  size_t total = (size_t) distance(begin, end);
+  if (total > 1000) {
+    printf("%zu words, %s\n", total, is_sorted(begin, end) ? "sorted" : "NOT SORTED");
+    return;
+  }
 
-  const int TN = 4;   // number of arrays and threads to create
-  
-  // Create 4 arrays, each array contains 5 words
-  string words[TN][numWords] =
-    { {"promotional", "drafted", "slog", "cronkite", "camber"},
-      {"scatted", "overused", "promiscuity", "legatee", "bettor"},
-      {"reentering", "satirist", "sawmill", "upchucks", "unseasonable"},
-      {"testimonials", "upstairs", "discrepancies", "mascaraed", "darcy"} };
-      
-  
+  printf("The list of words:\n");
+  for (; begin != end; begin++)
+  {
+    printf("Word: %.*s\n", (int) (*begin).size(), (*begin).data());
+  }
+}
+
+static inline bool count_greater(const WordCount &x, const WordCount &y)
+{
+  if (x.count != y.count) {
+    return x.count > y.count;
+  }
+  return x.word < y.word;
+}
+
+static inline bool word_less(const WordCount &x, const WordCount &y)
+{
+  return x.word < y.word;
+}
+
+// Print wordCounts, like print_words()
+void print_counts()
+{
+  bool (*less)(const WordCount &, const WordCount &) = byFrequency ? count_greater : word_less;
+  if (wordCounts.size() > 1000) {
+    printf("%zu distinct words, %s\n", wordCounts.size(),
+           is_sorted(wordCounts.begin(), wordCounts.end(), less) ? "sorted" : "NOT SORTED");
+    return;
+  }
+
+  printf("The list of words:\n");
+  for (size_t i = 0; i < wordCounts.size(); i++) {
+    printf("Word: %.*s %llu\n", (int) wordCounts[i].word.size(), wordCounts[i].word.data(),
+           (unsigned long long) wordCounts[i].count);
+  }
+}
+
+// Print the result of collect_and_sort(), and free it
+void print_result()
+{
+  if (mode == LIST) {
+    print_words(wordList.begin(), wordList.end());
+  } else if (mode == COUNT) {
+    print_counts();
+    free_shards();
+  } else {
+    print_words(sortedWords.begin(), sortedWords.end());
+    free_shards();
+  }
+}
+
+
+// Make up numWords random lowercase words for every one of the TN
+// threads.  Each thread's words come from its own seed, so the input
+// is the same from run to run.
+string *random_words(int TN)
+{
+  string *words = new string[(size_t) TN * (size_t) numWords];
+  for (int t = 0; t < TN; t++) {
+    unsigned long long x = 88172645463325252ULL + (unsigned long long) t;
+    for (int i = 0; i < numWords; i++) {
+      char w[16];
+      x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+      int len = 3 + (int) ((x >> 33) % 10);
+      for (int k = 0; k < len; k++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        w[k] = (char) ('a' + (x >> 33) % 26);
+      }
+      words[(size_t) t * (size_t) numWords + (size_t) i].assign(w, (size_t) len);
+    }
+  }
+  return words;
+}
+
+
+// Give numWords words from words[] to each of the TN jobs
+void array_jobs(InsertJob jobs[], string *words, int TN)
+{
+  for (int i=0; i < TN; i++) {
+    jobs[i].id = i;
+    jobs[i].words = words + (size_t) i * (size_t) numWords;
+    jobs[i].begin = jobs[i].end = 0;
+    jobs[i].stats = LockStats();
+  }
+}
+
+
+// Map the file at path into memory, read-only, as fileText.
+//
+// Reading a multi-GB file with read() or ifstream would copy all of
+// it into our own buffers first.  With mmap, the kernel maps its
+// page cache straight into our address space, and the words can
+// point right into it.
+void map_file(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    exit(1);
+  }
+  fileSize = (size_t) st.st_size;
+  if (fileSize > 0) {
+    void *text = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (text == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    // each thread reads its piece front to back: read ahead aggressively
+    madvise(text, fileSize, MADV_SEQUENTIAL);
+    fileText = (const char *) text;
+  }
+  close(fd);
+}
+
+
+static inline bool is_delimiter(char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');  // space, \t \n \v \f \r
+}
+
+// Split fileText into TN pieces of about the same size, one per job.
+// Each cut is moved forward to the next delimiter, so that no word is
+// split between two jobs.
+void file_jobs(InsertJob jobs[], int TN)
+{
+  size_t begin = 0;
+  for (int i=0; i < TN; i++) {
+    size_t end = fileSize / (size_t) TN * (size_t) (i + 1);
+    if (i == TN - 1) {
+      end = fileSize;
+    } else if (end < begin) {
+      end = begin;
+    }
+    while (end < fileSize && !is_delimiter(fileText[end])) {
+      end++;
+    }
+    jobs[i].id = i;
+    jobs[i].words = 0;
+    jobs[i].begin = begin;
+    jobs[i].end = end;
+    jobs[i].stats = LockStats();
+    begin = end;
+  }
+}
+
+
+// Add every word in text[begin, end) to shard, as a reference into
+// text.  A word is a run of bytes that are not delimiters.
+//
+// tokenize_avx2 does the same 32 bytes at a time: it compares all 32
+// against the delimiters at once, giving a 32-bit mask with a 1 for
+// every delimiter, and finds the word starts and ends from the 0->1
+// and 1->0 transitions of the mask, with count-trailing-zeros.
+static void tokenize_scalar(const char *text, size_t begin, size_t end, Shard *shard)
+{
+  size_t i = begin;
+  while (i < end) {
+    while (i < end && is_delimiter(text[i])) {
+      i++;
+    }
+    size_t start = i;
+    while (i < end && !is_delimiter(text[i])) {
+      i++;
+    }
+    if (i > start) {
+      shard->add_ref(start, i - start);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void tokenize_avx2(const char *text, size_t begin, size_t end, Shard *shard)
+{
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i four = _mm256_set1_epi8(4);
+  size_t i = begin;
+  size_t wordStart = 0;
+  uint64_t prevInWord = 0;  // 1 if the byte before text[i] is part of a word
+
+  for (; i + 32 <= end; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *) (text + i));
+    // '\t'..'\r' are 5 consecutive codes: x - '\t' <= 4, unsigned
+    __m256i ctl = _mm256_sub_epi8(x, tab);
+    __m256i isCtl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl);
+    __m256i isSpace = _mm256_cmpeq_epi8(x, space);
+    uint32_t delim = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(isCtl, isSpace));
+
+    uint64_t inWord = (uint32_t) ~delim;
+    uint64_t prev = (inWord << 1) | prevInWord;  // bit k: byte k-1 is in a word
+    uint64_t starts = inWord & ~prev;
+    uint64_t ends = ~inWord & prev & 0xFFFFFFFFULL;  // first delimiter after a word
+    prevInWord = inWord >> 31;
+
+    uint64_t events = starts | ends;
+    while (events) {
+      size_t pos = i + (size_t) __builtin_ctzll(events);
+      if (starts & events & -events) {
+        wordStart = pos;
+      } else {
+        shard->add_ref(wordStart, pos - wordStart);
+      }
+      events &= events - 1;
+    }
+  }
+
+  // A word may be running into the last (< 32) bytes
+  if (prevInWord) {
+    while (i < end && !is_delimiter(text[i])) {
+      i++;
+    }
+    shard->add_ref(wordStart, i - wordStart);
+  }
+  tokenize_scalar(text, i, end, shard);
+}
+
+static void (*pick_tokenizer())(const char *, size_t, size_t, Shard *)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? tokenize_avx2 : tokenize_scalar;
+}
+
+static void (*tokenize)(const char *, size_t, size_t, Shard *) = pick_tokenizer();
+
+
+pthread_barrier_t countBarrier;  // COUNT mode: see count_shard()
+
+double now();
+double insertTime;  // seconds the last collect_and_sort() spent adding words
+
+// Add the words of each job with TN threads, and sort them: into
+// wordList in LIST mode, into wordCounts in COUNT mode, and into
+// sortedWords otherwise.
+void collect_and_sort(InsertJob jobs[], int TN)
+{
   // We use each thread to add an array of words into the list wordList
 
   pthread_t threads[TN];
+  pthread_t consumers[TN];
+  shards.assign((size_t) TN, Shard());
+  if (mode == COUNT) {
+    pthread_barrier_init(&countBarrier, 0, (unsigned) TN);
+  }
+  if (mode == PIPELINE) {
+    // the sorting threads start first, and wait for words
+    start_pipeline(TN);
+    for (int i=0; i < TN; i++) {
+      pthread_create(&consumers[i], 0, consume, (void *) &shards[(size_t) i]);
+    }
+  }
   
   // create TN threads
+  ThreadProfile profiles[TN];
+  insertTime = now();
   for (int i=0; i < TN; i++) {
-    pthread_create(&threads[i], 0, insert, (void *) &words[i]);
+    profiles[i] = ThreadProfile();
+    jobs[i].profile = &profiles[i];
+    pthread_create(&threads[i], 0, insert, (void *) &jobs[i]);
   }
   
   // wait until all threads are complete before main() continues
   for (int i=0; i < TN; i++) {
     pthread_join(threads[i], 0);
-    printf("Thread completed.\n");
+    if (verbose) {
+      printf("Thread completed.\n");
+    }
+  }
+  insertTime = now() - insertTime;
+  profile_report("insert", profiles, TN);
+
+  if (mode == LIST) {
+    // sort the linked list
+    wordList.sort();
+  } else if (mode == PIPELINE) {
+    // each sorting thread is left with one run; merge those
+    for (int i=0; i < TN; i++) {
+      pthread_join(consumers[i], 0);
+    }
+    merge_shards(TN);
+  } else if (mode == SHARDED) {
+    merge_shards(TN);
+  } else if (mode == COUNT) {
+    pthread_barrier_destroy(&countBarrier);
+    sort_counts();
+  } else {
+    radix_sort_words(TN);
+  }
+}
+
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+// Time collect_and_sort() in every mode, for 1M and 10M random words
+void benchmark(int TN)
+{
+  verbose = false;
+  for (int total = 1000000; total <= 10000000; total *= 10) {
+    numWords = total / TN;
+    string *words = random_words(TN);
+
+    for (int m = LIST; m <= PIPELINE; m++) {
+      mode = (Mode) m;
+      InsertJob jobs[TN];
+      array_jobs(jobs, words, TN);
+      double t = now();
+      collect_and_sort(jobs, TN);
+      t = now() - t;
+      printf("%-8s %9d words, %3d threads: %8.3f s\n", modeNames[m], numWords * TN, TN, t);
+
+      // free this mode's copies before the next one
+      wordList.clear();
+      sortedWords = vector<string_view>();
+      free_shards();
+    }
+    delete [] words;
+  }
+}
+
+
+// LIST mode: how the cost of counter_mutex changes with the number
+// of threads (1 to 64) and the batch size, for 1M random words.
+// The times are only for adding the words, not for sorting them.
+void lock_benchmark()
+{
+  verbose = false;
+  timeLocks = true;
+  mode = LIST;
+  const int total = 1 << 20;
+  const size_t batches[] = { 1, 16, 256, 4096 };
+
+  printf("threads  batch  insert s     locks  contended  wait us/lock  hold us/lock\n");
+  for (int TN = 1; TN <= 64; TN *= 2) {
+    numWords = total / TN;
+    string *words = random_words(TN);
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+      listBatch = batches[b];
+      InsertJob jobs[TN];
+      array_jobs(jobs, words, TN);
+      collect_and_sort(jobs, TN);
+
+      LockStats sum = LockStats();
+      for (int i = 0; i < TN; i++) {
+        sum.locks += jobs[i].stats.locks;
+        sum.contended += jobs[i].stats.contended;
+        sum.wait += jobs[i].stats.wait;
+        sum.hold += jobs[i].stats.hold;
+      }
+      printf("%7d  %5zu  %8.3f  %8llu  %8.1f%%  %12.3f  %12.3f\n", TN, listBatch, insertTime,
+             (unsigned long long) sum.locks, 100.0 * (double) sum.contended / (double) sum.locks,
+             sum.wait / (double) sum.locks * 1e6, sum.hold / (double) sum.locks * 1e6);
+      wordList.clear();
+      free_shards();
+    }
+    delete [] words;
+  }
+}
+
+
+void usage(const char *prog)
+{
+  printf("usage: %s [-m mode] [-o word|freq] [-k K] [threads words-per-thread]\n"
+         "       %s [-m mode] [-o word|freq] [-k K] -f file threads\n"
+         "       %s -b threads\n"
+         "       %s -l\n"
+         "Sorts threads*words-per-thread random words (by default, the 20\n"
+         "sample words with 4 threads), or the whitespace-separated words\n"
+         "of a file.\n"
+         "  -m  how the threads collect and sort the words: list, sharded,\n"
+         "      radix (default), pipeline, or count (each distinct word\n"
+         "      once, with how many times it occurs)\n"
+         "  -o  count mode: sort by word (default) or by decreasing count\n"
+         "  -k  count mode: only the K most frequent words\n"
+         "  -B  list mode: words per lock of the list (default 1024)\n"
+         "  -f  read the words from file\n"
+         "  -b  benchmark every mode with 1M and 10M words\n"
+         "  -l  measure the list lock with 1 to 64 threads\n", prog, prog, prog, prog);
+  exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  const char *prog = argv[0];
+  bool bench = false;
+  const char *file = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:bf:o:k:B:l")) != -1) {
+    if (opt == 'b') {
+      bench = true;
+      continue;
+    }
+    if (opt == 'l') {
+      lock_benchmark();
+      return 0;
+    }
+    if (opt == 'B' && atoi(optarg) > 0) {
+      listBatch = (size_t) atoi(optarg);
+      continue;
+    }
+    if (opt == 'f') {
+      file = optarg;
+      continue;
+    }
+    if (opt == 'o' && (!strcasecmp(optarg, "word") || !strcasecmp(optarg, "freq"))) {
+      byFrequency = !strcasecmp(optarg, "freq");
+      continue;
+    }
+    if (opt == 'k' && atoi(optarg) > 0) {
+      topK = (size_t) atoi(optarg);
+      byFrequency = true;
+      continue;
+    }
+    int m = LIST;
+    while (opt == 'm' && m <= PIPELINE && strcasecmp(optarg, modeNames[m])) {
+      m++;
+    }
+    if (opt != 'm' || m > PIPELINE) {
+      usage(prog);
+    }
+    mode = (Mode) m;
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (bench && argc == 2) {
+    benchmark(atoi(argv[1]));
+    return 0;
+  }
+  if (file && argc == 2) {
+    int TN = atoi(argv[1]);
+    assert(TN > 0);
+    map_file(file);
+    InsertJob jobs[TN];
+    file_jobs(jobs, TN);
+    collect_and_sort(jobs, TN);
+    print_result();
+    if (fileText) {
+      munmap((void *) fileText, fileSize);
+    }
+    return 0;
+  }
+  if (bench || file || (argc != 1 && argc != 3)) {
+    usage(prog);
   }
 
-  // sort the linked list
-  wordList.sort();
+  int TN = 4;   // number of arrays and threads to create
   
-  // Print the resulting list of words in wordList
-  // The words should be in sorted order
-  printf("The list of words:\n");
+  // Create 4 arrays, each array contains 5 words
+  string sample[4][5] =
+    { {"promotional", "drafted", "slog", "cronkite", "camber"},
+      {"scatted", "overused", "promiscuity", "legatee", "bettor"},
+      {"reentering", "satirist", "sawmill", "upchucks", "unseasonable"},
+      {"testimonials", "upstairs", "discrepancies", "mascaraed", "darcy"} };
+  string *words = &sample[0][0];
 
-  list<string>::iterator itList = wordList.begin();
-  list<string>::iterator endList = wordList.end();
-  for (; itList != endList; itList++)
-  {
-    printf("Word: %s\n", (*itList).c_str());
+  if (argc == 3) {
+    TN = atoi(argv[1]);
+    numWords = atoi(argv[2]);
+    assert(TN > 0);
+    assert(numWords >= 0);
+    words = random_words(TN);
   }
+      
   
+  InsertJob jobs[TN];
+  array_jobs(jobs, words, TN);
+  collect_and_sort(jobs, TN);
+
+  // Print the resulting list of words
+  // The words should be in sorted order
+  print_result();
   
+  if (words != &sample[0][0]) {
+    delete [] words;
+  }
   return 0;
 }
 
 
 // This function runs in a thread
 // Adds words from an array into the linked list wordList
-void * insert(void * param)
+// (LIST mode) or into this thread's shard (the other modes)
+void * insert_words(void * param)
 {
 
-  printf("Thread created.\n");
+  if (verbose) {
+    printf("Thread created.\n");
+  }
   
-  string *words = (string *) param;   // an array of words
+  InsertJob *job = (InsertJob *) param;
+  const string *words = job->words;   // an array of words
+
+  if (mode == PIPELINE) {
+    produce(job);
+    return 0;
+  }
+
+  if (!words) {
+    // Words from the file: find them in our piece of it, and keep
+    // them in place.
+    Shard &shard = shards[(size_t) job->id];
+    shard.bytes = fileText;
+    tokenize(fileText, job->begin, job->end, &shard);
+
+    if (mode == LIST) {
+      // The list holds std::strings, so here they do get copied
+      list<string> batch;
+      for (size_t i = 0; i < shard.size(); i++) {
+        batch.push_back(string(shard.word(i)));
+        if (batch.size() == listBatch) {
+          insert_batch(batch, job);
+        }
+      }
+      insert_batch(batch, job);
+      return 0;
+    }
+  } else if (mode != LIST) {
+    // Nobody else touches shards[job->id], so no mutex.  We know
+    // how many bytes are coming, so the arena is only allocated once.
+    Shard &shard = shards[(size_t) job->id];
+    size_t bytes = 0;
+    for (int i = 0; i < numWords; i++) {
+      bytes += words[i].size();
+    }
+    shard.reserve(bytes);
+    shard.refs.reserve((size_t) numWords);
+    for (int i = 0; i < numWords; i++) {
+      shard.add(words[i].data(), words[i].size());
+    }
+  }
+
+  if (mode != LIST) {
+    // In SHARDED mode the shard is sorted here too, while the other
+    // threads are busy with theirs; merge_shards() only has to merge.
+    Shard &shard = shards[(size_t) job->id];
+    if (mode == SHARDED) {
+      shard.views.resize(shard.size());
+      for (size_t i = 0; i < shard.size(); i++) {
+        shard.views[i] = shard.word(i);
+      }
+      sort(shard.views.begin(), shard.views.end());
+    } else if (mode == COUNT) {
+      count_shard((size_t) job->id);
+    }
+    return 0;
+  }
 
   // TODO: for each word in words[], add it to the end of wordList
   // You will need to use a mutex to ensure the add process does not have collisions.
+  // The words are first added to our own list, without the mutex,
+  // and moved to wordList listBatch at a time.
+  list<string> batch;
   for (int i = 0; i<numWords; i++)
   { 
-    pthread_mutex_lock( &counter_mutex );
-    wordList.push_back(words[i]);
-    pthread_mutex_unlock( &counter_mutex );
+    batch.push_back(words[i]);
+    if (batch.size() == listBatch) {
+      insert_batch(batch, job);
+    }
   }
+  insert_batch(batch, job);
   
   return 0;
 }
+
+
+// insert_words(), profiled (see instrument.h).  The units are words,
+// or in file mode, bytes of the file.
+void * insert(void * param)
+{
+  InsertJob *job = (InsertJob *) param;
+  profile_begin(job->profile);
+  insert_words(param);
+  profile_units(job->profile, job->words ? (uint64_t) numWords : (uint64_t) (job->end - job->begin));
+  profile_end(job->profile);
+  return 0;
+}
+
+
+// Move all the words of batch to the end of wordList, leaving batch
+// empty.
+//
+// Taking counter_mutex for every word means one lock and unlock per
+// word, and with many threads, mostly waiting for it.  splice() moves
+// the whole batch by relinking its first and last nodes, so the lock
+// is held for the same short time whatever the batch size, and taken
+// listBatch times less often.  The words keep their order within a
+// batch, but batches from different threads are interleaved, as
+// single words were before.
+void insert_batch(list<string> &batch, InsertJob *job)
+{
+  if (batch.empty()) {
+    return;
+  }
+  LockStats *stats = &job->stats;
+  double t0 = timeLocks ? now() : 0;
+  if (profile_lock( job->profile, &counter_mutex )) {
+    stats->contended++;
+  }
+  double t1 = timeLocks ? now() : 0;
+  wordList.splice(wordList.end(), batch);
+  double t2 = timeLocks ? now() : 0;
+  pthread_mutex_unlock( &counter_mutex );
+
+  stats->locks++;
+  stats->wait += t1 - t0;
+  stats->hold += t2 - t1;
+}
+
+
+void free_counts();
+
+// Free the words of all the shards at once (and in COUNT mode, the
+// hash table and wordCounts, which point into them)
+void free_shards()
+{
+  free_counts();
+  for (size_t s = 0; s < shards.size(); s++) {
+    shards[s].release();
+  }
+  shards.clear();
+}
+
+
+// Parallel merge of the sorted shards into sortedWords.
+//
+// Merging the shards two at a time would leave the last merge, of
+// all the words, to a single thread.  Instead, the words are split
+// into TN ranges of values by TN-1 "splitter" words, chosen from a
+// sample of every shard.  Thread t takes the words between splitter
+// t-1 and splitter t from every shard (a binary search per shard
+// finds them), and merges them into its own part of sortedWords.
+// The threads write to disjoint parts of sortedWords, so again no
+// mutex is needed.
+
+// bounds[t][s]: the words of shard s that go to merge thread t are
+// shards[s].views[bounds[t][s] .. bounds[t+1][s])
+vector< vector<size_t> > bounds;
+
+struct MergeJob
+{
+  int id;         // merge thread number t
+  size_t offset;  // where thread t's words start in sortedWords
+};
+
+void * merge_thread(void * param)
+{
+  MergeJob *job = (MergeJob *) param;
+  size_t t = (size_t) job->id;
+  size_t out = job->offset;
+
+  // k-way merge with a heap of (word, shard) pairs: the top of the
+  // heap is the smallest word that has not been output yet.
+  typedef pair<string_view, size_t> Head;
+  struct Greater {
+    bool operator()(const Head &x, const Head &y) const { return x.first > y.first; }
+  };
+  priority_queue<Head, vector<Head>, Greater> heap;
+  vector<size_t> pos(bounds[t]);
+
+  for (size_t s = 0; s < shards.size(); s++) {
+    if (pos[s] < bounds[t + 1][s]) {
+      heap.push(Head(shards[s].views[pos[s]], s));
+    }
+  }
+  while (!heap.empty()) {
+    size_t s = heap.top().second;
+    heap.pop();
+    sortedWords[out++] = shards[s].views[pos[s]++];
+    if (pos[s] < bounds[t + 1][s]) {
+      heap.push(Head(shards[s].views[pos[s]], s));
+    }
+  }
+  return 0;
+}
+
+void merge_shards(int TN)
+{
+  size_t numShards = shards.size();
+  size_t total = 0;
+  for (size_t s = 0; s < numShards; s++) {
+    total += shards[s].views.size();
+  }
+  if (total == 0) {
+    // no words, so no sample to take splitters from
+    sortedWords.clear();
+    return;
+  }
+
+  // Take TN evenly spaced words from every shard, and pick every
+  // TN-th of them as a splitter: each range then holds about
+  // total/TN words.
+  vector<string_view> sample;
+  for (size_t s = 0; s < numShards; s++) {
+    vector<string_view> &views = shards[s].views;
+    for (size_t k = 0; k < (size_t) TN && !views.empty(); k++) {
+      sample.push_back(views[views.size() * k / (size_t) TN]);
+    }
+  }
+  sort(sample.begin(), sample.end());
+
+  bounds.assign((size_t) TN + 1, vector<size_t>(numShards));
+  for (size_t s = 0; s < numShards; s++) {
+    bounds[0][s] = 0;
+    bounds[(size_t) TN][s] = shards[s].views.size();
+    for (size_t t = 1; t < (size_t) TN; t++) {
+      string_view splitter = sample[sample.size() * t / (size_t) TN];
+      vector<string_view> &views = shards[s].views;
+      bounds[t][s] = (size_t) (lower_bound(views.begin(), views.end(), splitter) -
+                               views.begin());
+    }
+  }
+
+  sortedWords.assign(total, string_view());
+
+  pthread_t threads[TN];
+  MergeJob jobs[TN];
+  size_t offset = 0;
+  for (int t = 0; t < TN; t++) {
+    jobs[t].id = t;
+    jobs[t].offset = offset;
+    for (size_t s = 0; s < numShards; s++) {
+      offset += bounds[(size_t) t + 1][s] - bounds[(size_t) t][s];
+    }
+    pthread_create(&threads[t], 0, merge_thread, (void *) &jobs[t]);
+  }
+  for (int t = 0; t < TN; t++) {
+    pthread_join(threads[t], 0);
+  }
+}
+
+
+// Parallel radix sort of all the words in the shards, into sortedWords.
+//
+// Comparing two words means following two pointers to their
+// characters, and std::list::sort does that on nodes scattered all
+// over the heap.  Instead, each word gets a SortKey in one contiguous
+// array: its first 8 bytes, packed into an integer so that comparing
+// the integers compares the words (the last bytes are 0 for short
+// words, and 0 sorts before every letter).  Most comparisons are
+// then decided by the keys alone, and only words that share their
+// first 8 bytes are compared in full.
+//
+// The sort itself is an MSD ("most significant digit first") radix
+// sort, one byte of the key at a time:
+//  1. Each thread makes the keys of its own shard and counts how
+//     many start with each byte value (its histogram).
+//  2. From all the histograms, main() works out where each thread's
+//     words of each bucket go, and the threads move them there.
+//  3. The 256 buckets are now independent sorting problems.  The
+//     threads take them from a shared stack of tasks.  A bucket that
+//     is still large is split again on its next byte, and the pieces
+//     go back on the stack; a small one is sorted with std::sort.
+
+struct SortKey
+{
+  uint64_t key;  // first 8 bytes of word, big-endian
+  string_view word;
+};
+
+// return byte d (0 = first) of the word, as stored in the key
+static inline unsigned key_byte(const SortKey &k, int d)
+{
+  return (unsigned) (k.key >> (56 - 8 * d)) & 255;
+}
+
+static inline bool key_less(const SortKey &x, const SortKey &y)
+{
+  if (x.key != y.key) {
+    return x.key < y.key;
+  }
+  return x.word < y.word;
+}
+
+// A bucket still to be sorted: keys[begin..end) of one of the two
+// arrays below, whose words all have the same first `depth` bytes
+struct SortTask
+{
+  size_t begin;
+  size_t end;
+  int depth;
+  int array;  // 0: radixKeys, 1: radixTmp
+};
+
+const size_t smallBucket = 1024;  // buckets up to this size use std::sort
+
+struct RadixState
+{
+  SortKey *keys[2];              // two arrays of all the keys; each split moves them across
+  vector< vector<size_t> > counts; // counts[t][c]: words of shard t that start with byte c
+  vector<size_t> offsets;        // offsets[t]: where shard t's keys start
+
+  // stack of tasks for step 3
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  vector<SortTask> tasks;
+  int busy;                      // threads working on a task; when 0 and no tasks: done
+};
+
+RadixState radix;
+
+struct RadixJob
+{
+  int id;
+};
+
+void * radix_count_thread(void * param)
+{
+  size_t t = (size_t) ((RadixJob *) param)->id;
+  Shard &shard = shards[t];
+  SortKey *keys = radix.keys[1] + radix.offsets[t];
+  vector<size_t> &count = radix.counts[t];
+
+  for (size_t i = 0; i < shard.size(); i++) {
+    string_view word = shard.word(i);
+    unsigned char bytes[8] = { 0 };
+    memcpy(bytes, word.data(), min(word.size(), (size_t) 8));
+    uint64_t key = 0;
+    memcpy(&key, bytes, 8);
+    keys[i].key = __builtin_bswap64(key);  // first byte becomes most significant
+    keys[i].word = word;
+    count[key_byte(keys[i], 0)]++;
+  }
+  return 0;
+}
+
+void * radix_scatter_thread(void * param)
+{
+  size_t t = (size_t) ((RadixJob *) param)->id;
+  SortKey *from = radix.keys[1] + radix.offsets[t];
+  size_t n = shards[t].size();
+  vector<size_t> &pos = radix.counts[t];  // now: where the next word of each bucket goes
+
+  for (size_t i = 0; i < n; i++) {
+    radix.keys[0][pos[key_byte(from[i], 0)]++] = from[i];
+  }
+  return 0;
+}
+
+// Step 3 for one task: split it, or sort it and move its words to
+// sortedWords.  New tasks are pushed on the stack.
+void radix_task(const SortTask &task)
+{
+  SortKey *src = radix.keys[task.array] + task.begin;
+  size_t n = task.end - task.begin;
+
+  if (n <= smallBucket || task.depth == 8) {
+    sort(src, src + n, key_less);
+    for (size_t i = 0; i < n; i++) {
+      sortedWords[task.begin + i] = src[i].word;
+    }
+    return;
+  }
+
+  // Split on byte `depth` into the other array
+  SortKey *dst = radix.keys[1 - task.array] + task.begin;
+  size_t count[257] = { 0 };
+  for (size_t i = 0; i < n; i++) {
+    count[key_byte(src[i], task.depth) + 1]++;
+  }
+  for (int c = 0; c < 256; c++) {
+    count[c + 1] += count[c];
+  }
+  vector<SortTask> pieces;
+  for (int c = 0; c < 256; c++) {
+    if (count[c + 1] > count[c]) {
+      SortTask piece = { task.begin + count[c], task.begin + count[c + 1],
+                         task.depth + 1, 1 - task.array };
+      pieces.push_back(piece);
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    dst[count[key_byte(src[i], task.depth)]++] = src[i];
+  }
+
+  pthread_mutex_lock(&radix.mutex);
+  radix.tasks.insert(radix.tasks.end(), pieces.begin(), pieces.end());
+  pthread_cond_broadcast(&radix.cond);
+  pthread_mutex_unlock(&radix.mutex);
+}
+
+void * radix_sort_thread(void *)
+{
+  pthread_mutex_lock(&radix.mutex);
+  for (;;) {
+    while (radix.tasks.empty() && radix.busy > 0) {
+      pthread_cond_wait(&radix.cond, &radix.mutex);
+    }
+    if (radix.tasks.empty()) {
+      break;  // nobody is working, so no new tasks can appear
+    }
+    SortTask task = radix.tasks.back();
+    radix.tasks.pop_back();
+    radix.busy++;
+    pthread_mutex_unlock(&radix.mutex);
+
+    radix_task(task);
+
+    pthread_mutex_lock(&radix.mutex);
+    radix.busy--;
+    if (radix.busy == 0 && radix.tasks.empty()) {
+      pthread_cond_broadcast(&radix.cond);
+    }
+  }
+  pthread_mutex_unlock(&radix.mutex);
+  return 0;
+}
+
+void radix_sort_words(int TN)
+{
+  size_t numShards = shards.size();
+  size_t total = 0;
+  radix.offsets.assign(numShards, 0);
+  for (size_t s = 0; s < numShards; s++) {
+    radix.offsets[s] = total;
+    total += shards[s].size();
+  }
+  radix.keys[0] = new SortKey[total];
+  radix.keys[1] = new SortKey[total];
+  radix.counts.assign(numShards, vector<size_t>(256, 0));
+  sortedWords.assign(total, string_view());
+
+  pthread_t threads[TN];
+  RadixJob jobs[TN];
+
+  // step 1: one thread per shard (there are TN shards)
+  for (int t = 0; t < TN; t++) {
+    jobs[t].id = t;
+    pthread_create(&threads[t], 0, radix_count_thread, (void *) &jobs[t]);
+  }
+  for (int t = 0; t < TN; t++) {
+    pthread_join(threads[t], 0);
+  }
+
+  // Bucket c starts after all the words of buckets < c.  Within a
+  // bucket, shard 0's words come first, then shard 1's, etc.
+  vector<SortTask> buckets;
+  size_t pos = 0;
+  for (int c = 0; c < 256; c++) {
+    size_t begin = pos;
+    for (size_t t = 0; t < numShards; t++) {
+      size_t n = radix.counts[t][(size_t) c];
+      radix.counts[t][(size_t) c] = pos;
+      pos += n;
+    }
+    if (pos > begin) {
+      SortTask bucket = { begin, pos, 1, 0 };
+      buckets.push_back(bucket);
+    }
+  }
+
+  // step 2
+  for (int t = 0; t < TN; t++) {
+    pthread_create(&threads[t], 0, radix_scatter_thread, (void *) &jobs[t]);
+  }
+  for (int t = 0; t < TN; t++) {
+    pthread_join(threads[t], 0);
+  }
+
+  // step 3
+  pthread_mutex_init(&radix.mutex, 0);
+  pthread_cond_init(&radix.cond, 0);
+  radix.tasks = buckets;
+  radix.busy = 0;
+  for (int t = 0; t < TN; t++) {
+    pthread_create(&threads[t], 0, radix_sort_thread, 0);
+  }
+  for (int t = 0; t < TN; t++) {
+    pthread_join(threads[t], 0);
+  }
+  pthread_mutex_destroy(&radix.mutex);
+  pthread_cond_destroy(&radix.cond);
+
+  delete [] radix.keys[0];
+  delete [] radix.keys[1];
+}
+
+
+// COUNT mode: all the insert() threads add their words to one hash
+// table, without any lock.
+//
+// The table uses open addressing: a word's hash picks a slot, and if
+// that slot holds a different word, the next slot is tried, and so
+// on.  A slot does not hold the word itself but which word of which
+// shard it is, so claiming an empty slot is a single compare-and-swap
+// of one integer from 0 to that id.  If two threads race for the
+// same empty slot, one CAS fails, and that thread sees the winner's
+// word: if it is the same word, it just counts it there.  The counts
+// are atomic additions.
+//
+// The table never grows (growing it while the other threads are
+// using it is hard), so it is made big enough for all the words
+// before anyone adds any: every thread first fills its shard, then
+// they all wait at countBarrier, and one of them sizes the table
+// from the total number of words.  At most half the slots are then
+// ever used, so the probe sequences stay short.
+
+struct CountSlot
+{
+  atomic<uint64_t> id;     // 0: empty; else 1 + (shard << 40 | index in shard)
+  atomic<uint64_t> count;
+};
+
+CountSlot *countTable = 0;
+size_t countCapacity = 0;   // a power of 2
+
+static inline uint64_t word_id(size_t shard, size_t i)
+{
+  return 1 + ((uint64_t) shard << 40 | i);
+}
+
+static inline string_view id_word(uint64_t id)
+{
+  id--;
+  return shards[id >> 40].word(id & ((1ULL << 40) - 1));
+}
+
+static void count_word(string_view word, uint64_t id)
+{
+  size_t mask = countCapacity - 1;
+  for (size_t i = hash<string_view>()(word) & mask; ; i = (i + 1) & mask) {
+    CountSlot &slot = countTable[i];
+    // The shards were all filled before the barrier, so any id we
+    // find can be looked up: relaxed ordering is enough.
+    uint64_t cur = slot.id.load(memory_order_relaxed);
+    if (cur == 0 && slot.id.compare_exchange_strong(cur, id, memory_order_relaxed)) {
+      slot.count.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    // cur is now the id in the slot (ours, if the CAS failed because
+    // another thread just put the same word there)
+    if (id_word(cur) == word) {
+      slot.count.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+// Run by insert() thread t once its shard is full
+void count_shard(size_t t)
+{
+  if (pthread_barrier_wait(&countBarrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+    size_t total = 0;
+    for (size_t s = 0; s < shards.size(); s++) {
+      total += shards[s].size();
+    }
+    countCapacity = 16;
+    while (countCapacity < 2 * total) {
+      countCapacity *= 2;
+    }
+    countTable = new CountSlot[countCapacity]();  // () zeroes every slot
+  }
+  pthread_barrier_wait(&countBarrier);
+
+  Shard &shard = shards[t];
+  assert(shard.size() < (1ULL << 40));
+  for (size_t i = 0; i < shard.size(); i++) {
+    count_word(shard.word(i), word_id(t, i));
+  }
+}
+
+// Gather the used slots into wordCounts and sort them.  With topK,
+// partial_sort only puts the K most frequent words in order, which
+// is much less work than sorting all of them.
+void sort_counts()
+{
+  wordCounts.clear();
+  for (size_t i = 0; i < countCapacity; i++) {
+    uint64_t id = countTable[i].id.load(memory_order_relaxed);
+    if (id) {
+      WordCount wc = { id_word(id), countTable[i].count.load(memory_order_relaxed) };
+      wordCounts.push_back(wc);
+    }
+  }
+
+  if (topK > 0 && topK < wordCounts.size()) {
+    partial_sort(wordCounts.begin(), wordCounts.begin() + (ptrdiff_t) topK,
+                 wordCounts.end(), count_greater);
+    wordCounts.resize(topK);
+  } else {
+    sort(wordCounts.begin(), wordCounts.end(), byFrequency ? count_greater : word_less);
+  }
+}
+
+void free_counts()
+{
+  delete [] countTable;
+  countTable = 0;
+  countCapacity = 0;
+  wordCounts = vector<WordCount>();
+}
+
+
+// PIPELINE mode: the insert() threads only produce words; TN other
+// threads consume and sort them at the same time.
+//
+// The words go through `ring`, a fixed-size circular queue of
+// batches, that any producer can add to and any consumer can take
+// from, without a lock (Dmitry Vyukov's bounded MPMC queue): each
+// cell has a sequence number that says whether it is ready to be
+// written (seq == pos) or read (seq == pos + 1) by whoever claims
+// position pos, and producers and consumers claim positions with a
+// CAS on head and tail.  When the ring is full, producers wait until
+// a batch is taken, so however many words there are, at most
+// ringSize batches are ever waiting.
+//
+// A thread that has to wait (a consumer on an empty ring, a producer
+// on a full one) sleeps on a condition variable instead of spinning:
+// with TN producers and TN consumers on TN cores, a spinning consumer
+// takes CPU time from the very producers it is waiting for.  The
+// other side only takes the mutex to wake it if the sleeper count
+// says someone is asleep, so while nobody waits, the ring stays
+// lock-free.  The sleeper announces itself, then checks the ring
+// again; the other side changes the ring, then reads the count.  With
+// a seq_cst fence between the two steps on both sides, at least one
+// of them sees the other, so no wakeup is lost.
+//
+// A batch is just string_views of the words, which stay where they
+// are (in the words[] arrays or the mapped file).  A consumer sorts
+// each batch it gets into a run, and keeps a stack of runs in which
+// each run is longer than the one above it: a new run is merged with
+// the top of the stack as long as it is at least as long (like
+// adding 1 to a binary counter).  So each word is merged about
+// log2(its thread's words / batchSize) times, spread over the time the producers run, and when
+// the last batch has arrived, there are only a few short runs to
+// merge.  The consumers' final runs are then merged in parallel by
+// merge_shards().
+
+const size_t batchSize = 4096;  // words per batch
+const size_t ringSize = 64;     // batches; a power of 2
+
+struct Batch
+{
+  vector<string_view> words;
+};
+
+struct RingCell
+{
+  atomic<size_t> seq;
+  Batch *batch;
+};
+
+struct Ring
+{
+  RingCell cells[ringSize];
+  alignas(64) atomic<size_t> head;  // next position to write
+  alignas(64) atomic<size_t> tail;  // next position to read
+  alignas(64) atomic<int> producers; // insert() threads still running
+  alignas(64) atomic<int> idleConsumers;    // asleep on notEmpty
+  atomic<int> blockedProducers;             // asleep on notFull
+  pthread_mutex_t parkMutex;
+  pthread_cond_t notEmpty;  // a batch was pushed, or the last producer finished
+  pthread_cond_t notFull;   // a batch was taken
+};
+
+Ring ring = { {}, {0}, {0}, {0}, {0}, {0}, PTHREAD_MUTEX_INITIALIZER,
+              PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+void start_pipeline(int TN)
+{
+  for (size_t i = 0; i < ringSize; i++) {
+    ring.cells[i].seq.store(i, memory_order_relaxed);
+  }
+  ring.head.store(0, memory_order_relaxed);
+  ring.tail.store(0, memory_order_relaxed);
+  ring.producers.store(TN, memory_order_relaxed);
+  ring.idleConsumers.store(0, memory_order_relaxed);
+  ring.blockedProducers.store(0, memory_order_relaxed);
+}
+
+// Whether the cell at tail holds a batch / the cell at head is free.
+// A seq past what we expect means another thread just took the
+// position, so look again at the new one.
+static bool ring_has_batch()
+{
+  for (;;) {
+    size_t pos = ring.tail.load(memory_order_relaxed);
+    size_t seq = ring.cells[pos & (ringSize - 1)].seq.load(memory_order_acquire);
+    if (seq <= pos + 1) {
+      return seq == pos + 1;
+    }
+  }
+}
+
+static bool ring_has_space()
+{
+  for (;;) {
+    size_t pos = ring.head.load(memory_order_relaxed);
+    size_t seq = ring.cells[pos & (ringSize - 1)].seq.load(memory_order_acquire);
+    if (seq <= pos) {
+      return seq == pos;
+    }
+  }
+}
+
+// Wake one thread sleeping on cond, if sleepers says there is one.
+// Called after changing the ring.
+static void ring_wake(atomic<int> &sleepers, pthread_cond_t *cond)
+{
+  atomic_thread_fence(memory_order_seq_cst);
+  if (sleepers.load(memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&ring.parkMutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&ring.parkMutex);
+  }
+}
+
+// Sleep until the ring is not full
+static void wait_for_space()
+{
+  pthread_mutex_lock(&ring.parkMutex);
+  ring.blockedProducers.fetch_add(1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!ring_has_space()) {
+    pthread_cond_wait(&ring.notFull, &ring.parkMutex);
+  }
+  ring.blockedProducers.fetch_sub(1, memory_order_relaxed);
+  pthread_mutex_unlock(&ring.parkMutex);
+}
+
+// Sleep until the ring is not empty, or every producer has finished
+static void wait_for_batch()
+{
+  pthread_mutex_lock(&ring.parkMutex);
+  ring.idleConsumers.fetch_add(1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (!ring_has_batch() && ring.producers.load(memory_order_acquire) > 0) {
+    pthread_cond_wait(&ring.notEmpty, &ring.parkMutex);
+  }
+  ring.idleConsumers.fetch_sub(1, memory_order_relaxed);
+  pthread_mutex_unlock(&ring.parkMutex);
+}
+
+static void ring_push(Batch *batch)
+{
+  size_t pos = ring.head.load(memory_order_relaxed);
+  for (;;) {
+    RingCell &cell = ring.cells[pos & (ringSize - 1)];
+    size_t seq = cell.seq.load(memory_order_acquire);
+    if (seq == pos) {
+      if (ring.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+        cell.batch = batch;
+        cell.seq.store(pos + 1, memory_order_release);
+        ring_wake(ring.idleConsumers, &ring.notEmpty);
+        return;
+      }
+    } else {
+      if (seq < pos) {
+        wait_for_space();  // full: sleep until a consumer takes a batch
+      }
+      pos = ring.head.load(memory_order_relaxed);
+    }
+  }
+}
+
+// false if the ring is empty
+static bool ring_pop(Batch **batch)
+{
+  size_t pos = ring.tail.load(memory_order_relaxed);
+  for (;;) {
+    RingCell &cell = ring.cells[pos & (ringSize - 1)];
+    size_t seq = cell.seq.load(memory_order_acquire);
+    if (seq == pos + 1) {
+      if (ring.tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+        *batch = cell.batch;
+        cell.seq.store(pos + ringSize, memory_order_release);
+        ring_wake(ring.blockedProducers, &ring.notFull);
+        return true;
+      }
+    } else if (seq < pos + 1) {
+      return false;
+    } else {
+      pos = ring.tail.load(memory_order_relaxed);
+    }
+  }
+}
+
+// Send the words of job through the ring, batchSize at a time
+void produce(const InsertJob *job)
+{
+  Batch *batch = new Batch;
+  batch->words.reserve(batchSize);
+
+  if (job->words) {
+    for (int i = 0; i < numWords; i++) {
+      batch->words.push_back(string_view(job->words[i]));
+      if (batch->words.size() == batchSize) {
+        ring_push(batch);
+        batch = new Batch;
+        batch->words.reserve(batchSize);
+      }
+    }
+  } else {
+    // Tokenize the piece of the file 64 KB at a time, so that the
+    // word positions found but not yet sent stay few.
+    Shard scratch;
+    scratch.bytes = fileText;
+    size_t pos = job->begin;
+    while (pos < job->end) {
+      size_t cut = min(job->end, pos + 65536);
+      while (cut < job->end && !is_delimiter(fileText[cut])) {
+        cut++;
+      }
+      tokenize(fileText, pos, cut, &scratch);
+      for (size_t i = 0; i < scratch.size(); i++) {
+        batch->words.push_back(scratch.word(i));
+        if (batch->words.size() == batchSize) {
+          ring_push(batch);
+          batch = new Batch;
+          batch->words.reserve(batchSize);
+        }
+      }
+      scratch.refs.clear();
+      pos = cut;
+    }
+  }
+
+  if (batch->words.empty()) {
+    delete batch;
+  } else {
+    ring_push(batch);
+  }
+  if (ring.producers.fetch_sub(1, memory_order_acq_rel) == 1) {
+    // the last one: wake every idle consumer, to find the ring empty
+    // for good and finish
+    pthread_mutex_lock(&ring.parkMutex);
+    pthread_cond_broadcast(&ring.notEmpty);
+    pthread_mutex_unlock(&ring.parkMutex);
+  }
+}
+
+static vector<string_view> merge_runs(const vector<string_view> &x, const vector<string_view> &y)
+{
+  vector<string_view> out(x.size() + y.size());
+  merge(x.begin(), x.end(), y.begin(), y.end(), out.begin());
+  return out;
+}
+
+// A sorting thread: its final run goes to shard->views
+void * consume(void * param)
+{
+  Shard *shard = (Shard *) param;
+  vector< vector<string_view> > runs;
+
+  for (;;) {
+    // read this before trying the ring: if it was 0, every batch was
+    // already pushed, and an empty ring means we are done
+    bool done = ring.producers.load(memory_order_acquire) == 0;
+    Batch *batch;
+    if (!ring_pop(&batch)) {
+      if (done) {
+        break;
+      }
+      wait_for_batch();
+      continue;
+    }
+
+    vector<string_view> run;
+    run.swap(batch->words);
+    delete batch;
+    sort(run.begin(), run.end());
+    while (!runs.empty() && run.size() >= runs.back().size()) {
+      run = merge_runs(runs.back(), run);
+      runs.pop_back();
+    }
+    runs.push_back(vector<string_view>());
+    runs.back().swap(run);
+  }
+
+  // the smallest runs are on top: merge from there down
+  vector<string_view> run;
+  while (!runs.empty()) {
+    run = merge_runs(runs.back(), run);
+    runs.pop_back();
+  }
+  shard->views.swap(run);
+  return 0;
+}
@@ -5,22 +5,260 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../instrument.h"
+#include "../topology.h"
+
+// How the elements are accumulated.
+//  - NAIVE adds them up in order (with a few accumulators, see below).
+//    The rounding error can grow with n.
+//  - KAHAN uses Neumaier's improved Kahan summation: every addition
+//    also computes the bits that were rounded off, and adds those up
+//    separately.  The error no longer grows with n.
+//  - PAIRWISE adds the two halves of the array separately, and each
+//    half the same way, recursively.  The error grows with log(n).
+enum Mode { NAIVE, KAHAN, PAIRWISE };
+const char *modeNames[] = { "naive", "kahan", "pairwise" };
+
+// The array is reduced in fixed blocks of this many elements, no
+// matter how many threads there are.  Each thread computes the sums
+// of some of the blocks, and sum() combines the block sums in order.
+// That way the result does not depend on TN.
+const int blockSize = 4096;
 
 // a Job is a struct that represents the work that a thread
 // needs to do.  In this case, struct Job should contain
 // a pointer to the array, the start and the end indices, 
 // and a variable storing the result
-struct Job
-{
-  // TODO: Fill in this struct
-  double res;
-  double sliceLength; // length
-  double sliceStep;
-  double start;
-  double end; 
+//
+// The results go to blockSums[], once per block, and the adding
+// itself happens in registers.  The jobs still sit next to each
+// other in an array, so alignas(64) gives each one its own cache
+// line: a write to one job never evicts another thread's job from
+// its core's cache.  See sharing_benchmark() for what that costs.
+struct alignas(64) Job
+{
+  const double *A;  // the whole array
+  size_t start;     // first index of this job's chunk
+  size_t end;       // one past the last index of this job's chunk
+  Mode mode;
+  double *blockSums;  // shared by all jobs: sum of each block of A
+  double *blockComps; // shared by all jobs: KAHAN compensation of each block
+  ThreadProfile *profile; // this job's worker's, see instrument.h
 };
 
 
+// Kernels that add up x[0..n).
+//
+// A single accumulator makes every addition wait for the previous
+// one (4 cycles of latency on the lab machines), so the loops below
+// keep several independent partial sums and combine them at the end.
+// The AVX2 and AVX-512 versions add 4 or 8 doubles per instruction
+// on top of that.  They are compiled with the target attribute, so
+// the whole file still builds without -mavx2, and pick_kernel()
+// chooses one at run time based on what the CPU supports.
+//
+// The neumaier_* kernels do the same for KAHAN mode.  They return the
+// sum and, separately, the sum of the rounding errors (*comp).  Each
+// vector lane runs its own Neumaier summation, and the lanes are
+// combined with Neumaier summation at the end.
+
+static double sum_scalar(const double *x, int n)
+{
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i];
+    s1 += x[i + 1];
+    s2 += x[i + 2];
+    s3 += x[i + 3];
+  }
+  for (; i < n; i++) {
+    s0 += x[i];
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+__attribute__((target("avx2")))
+static double sum_avx2(const double *x, int n)
+{
+  __m256d s0 = _mm256_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x + i + 4));
+    s2 = _mm256_add_pd(s2, _mm256_loadu_pd(x + i + 8));
+    s3 = _mm256_add_pd(s3, _mm256_loadu_pd(x + i + 12));
+  }
+  __m256d s = _mm256_add_pd(_mm256_add_pd(s0, s1), _mm256_add_pd(s2, s3));
+  double lanes[4];
+  _mm256_storeu_pd(lanes, s);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]) + sum_scalar(x + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static double sum_avx512(const double *x, int n)
+{
+  __m512d s0 = _mm512_setzero_pd(), s1 = s0, s2 = s0, s3 = s0;
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    s0 = _mm512_add_pd(s0, _mm512_loadu_pd(x + i));
+    s1 = _mm512_add_pd(s1, _mm512_loadu_pd(x + i + 8));
+    s2 = _mm512_add_pd(s2, _mm512_loadu_pd(x + i + 16));
+    s3 = _mm512_add_pd(s3, _mm512_loadu_pd(x + i + 24));
+  }
+  __m512d s = _mm512_add_pd(_mm512_add_pd(s0, s1), _mm512_add_pd(s2, s3));
+  double lanes[8];
+  _mm512_storeu_pd(lanes, s);
+  return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+         ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7])) + sum_scalar(x + i, n - i);
+}
+
+// Add x to the Neumaier sum (*s, *c)
+static inline void neumaier_add(double *s, double *c, double x)
+{
+  double t = *s + x;
+  if (__builtin_fabs(*s) >= __builtin_fabs(x)) {
+    *c += (*s - t) + x;   // low bits of x were lost
+  } else {
+    *c += (x - t) + *s;   // low bits of *s were lost
+  }
+  *s = t;
+}
+
+static double neumaier_scalar(const double *x, int n, double *comp)
+{
+  double s = 0, c = 0;
+  for (int i = 0; i < n; i++) {
+    neumaier_add(&s, &c, x[i]);
+  }
+  *comp = c;
+  return s;
+}
+
+// Combine the lanes of a vector Neumaier sum, then add the tail
+static double neumaier_finish(const double *sums, const double *comps, int lanes,
+                              const double *x, int n, double *comp)
+{
+  double s = 0, c = 0;
+  for (int l = 0; l < lanes; l++) {
+    neumaier_add(&s, &c, sums[l]);
+    c += comps[l];
+  }
+  for (int i = 0; i < n; i++) {
+    neumaier_add(&s, &c, x[i]);
+  }
+  *comp = c;
+  return s;
+}
+
+__attribute__((target("avx2")))
+static inline void neumaier_step_avx2(__m256d *s, __m256d *c, __m256d x)
+{
+  const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFFLL));
+  __m256d t = _mm256_add_pd(*s, x);
+  __m256d sBigger = _mm256_cmp_pd(_mm256_and_pd(*s, absMask), _mm256_and_pd(x, absMask), _CMP_GE_OQ);
+  __m256d lostX = _mm256_add_pd(_mm256_sub_pd(*s, t), x);
+  __m256d lostS = _mm256_add_pd(_mm256_sub_pd(x, t), *s);
+  *c = _mm256_add_pd(*c, _mm256_blendv_pd(lostS, lostX, sBigger));
+  *s = t;
+}
+
+__attribute__((target("avx2")))
+static double neumaier_avx2(const double *x, int n, double *comp)
+{
+  __m256d s0 = _mm256_setzero_pd(), s1 = s0, c0 = s0, c1 = s0;
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    neumaier_step_avx2(&s0, &c0, _mm256_loadu_pd(x + i));
+    neumaier_step_avx2(&s1, &c1, _mm256_loadu_pd(x + i + 4));
+  }
+  double sums[8], comps[8];
+  _mm256_storeu_pd(sums, s0);
+  _mm256_storeu_pd(sums + 4, s1);
+  _mm256_storeu_pd(comps, c0);
+  _mm256_storeu_pd(comps + 4, c1);
+  return neumaier_finish(sums, comps, 8, x + i, n - i, comp);
+}
+
+__attribute__((target("avx512f")))
+static inline void neumaier_step_avx512(__m512d *s, __m512d *c, __m512d x)
+{
+  __m512d t = _mm512_add_pd(*s, x);
+  __mmask8 sBigger = _mm512_cmp_pd_mask(_mm512_abs_pd(*s), _mm512_abs_pd(x), _CMP_GE_OQ);
+  __m512d lostX = _mm512_add_pd(_mm512_sub_pd(*s, t), x);
+  __m512d lostS = _mm512_add_pd(_mm512_sub_pd(x, t), *s);
+  *c = _mm512_add_pd(*c, _mm512_mask_blend_pd(sBigger, lostS, lostX));
+  *s = t;
+}
+
+__attribute__((target("avx512f")))
+static double neumaier_avx512(const double *x, int n, double *comp)
+{
+  __m512d s0 = _mm512_setzero_pd(), s1 = s0, c0 = s0, c1 = s0;
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    neumaier_step_avx512(&s0, &c0, _mm512_loadu_pd(x + i));
+    neumaier_step_avx512(&s1, &c1, _mm512_loadu_pd(x + i + 8));
+  }
+  double sums[16], comps[16];
+  _mm512_storeu_pd(sums, s0);
+  _mm512_storeu_pd(sums + 8, s1);
+  _mm512_storeu_pd(comps, c0);
+  _mm512_storeu_pd(comps + 8, c1);
+  return neumaier_finish(sums, comps, 16, x + i, n - i, comp);
+}
+
+static double (*sum_kernel)(const double *, int);
+static double (*neumaier_kernel)(const double *, int, double *);
+
+static bool pick_kernels()
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    sum_kernel = sum_avx512;
+    neumaier_kernel = neumaier_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    sum_kernel = sum_avx2;
+    neumaier_kernel = neumaier_avx2;
+  } else {
+    sum_kernel = sum_scalar;
+    neumaier_kernel = neumaier_scalar;
+  }
+  return true;
+}
+
+static bool kernelsPicked = pick_kernels();
+
+
+// Pairwise sum of x[0..n): split in two halves until the pieces are
+// small enough for the vector kernel.  The pieces are cut at
+// multiples of 16 so every full vector load stays aligned the same
+// way.  The base case has 4 accumulators of up to 8 lanes, so it is
+// itself a small pairwise tree of depth 5.
+static double pairwise(const double *x, int n)
+{
+  if (n <= 256) {
+    return sum_kernel(x, n);
+  }
+  int half = (n / 2 + 15) / 16 * 16;
+  return pairwise(x, half) + pairwise(x + half, n - half);
+}
+
+
 // All threads will run this function when started.
 // The thread retrieves the job that was passed in as an argument, 
 // which contains the array, the start and the end indices of array,
@@ -31,118 +269,904 @@ struct Job
 static void *sum_thread(void *data)
 {
   Job *job = (Job *) data;
-  // TODO: Fill in this function
-  job->res = 0;
-  double slice;
-  double sliceEnd;
-  double i;
 
-  for ( slice = job->start; slice < job->end; slice += job->sliceStep ) {
-    sliceEnd = slice + job->sliceLength;
-    if ( sliceEnd > job->end ) {
-      sliceEnd = job->end;
+  profile_begin(job->profile);
+  // The chunk is made of whole blocks (except maybe the last block of A)
+  for (size_t i = job->start; i < job->end; i += blockSize) {
+    int n = job->end - i < blockSize ? (int) (job->end - i) : blockSize;
+    size_t k = i / blockSize;
+    switch (job->mode) {
+    case NAIVE:
+      job->blockSums[k] = sum_kernel(job->A + i, n);
+      break;
+    case KAHAN:
+      job->blockSums[k] = neumaier_kernel(job->A + i, n, &job->blockComps[k]);
+      break;
+    case PAIRWISE:
+      job->blockSums[k] = pairwise(job->A + i, n);
+      break;
     }
-    for ( i = slice; i < sliceEnd; i++ ) {
-      job->res += i;
+  }
+  profile_units(job->profile, (uint64_t) ((job->end - job->start + blockSize - 1) / blockSize));
+  profile_end(job->profile);
+  return 0;
+}
+
+
+// A pool of worker threads that live for the whole process.
+//
+// main() calls sum() 1000 times.  Creating and joining TN threads
+// on every call costs tens of microseconds, which is more than the
+// sum itself for small arrays.  Instead, the workers are created on
+// the first call, and wait on a condition variable between calls.
+// Each call "posts" its jobs by bumping the generation number and
+// waking the workers; worker i runs func(&jobs[i]) for i < numJobs.
+//
+// All fields are protected by mutex.
+const int maxPoolThreads = 256;
+
+struct Pool
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t start;      // signalled when a new batch of jobs is posted
+  pthread_cond_t done;       // signalled when the last job of a batch finishes
+  pthread_t threads[maxPoolThreads];
+  int seen[maxPoolThreads];  // last generation each worker has looked at
+  int size;                  // number of worker threads created so far
+  void *(*func)(void *);     // function to run on each job of this batch
+  Job *jobs;
+  int numJobs;
+  int pending;               // jobs of this batch not finished yet
+  int generation;            // incremented each time a batch is posted
+  bool quit;
+};
+
+static Pool pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                     PTHREAD_COND_INITIALIZER, {}, {}, 0, 0, 0, 0, 0, 0, false };
+
+// What worker i (or the i-th new thread, without the pool) did over
+// all the calls of sum(); see instrument.h.  main() reports them.
+static ThreadProfile profiles[maxPoolThreads];
+
+// Where the workers go (see topology.h), and unless that is
+// UNPINNED, the CPU worker i is pinned to (see place_workers())
+static Placement placement = UNPINNED;
+static int workerCpus[maxPoolThreads];
+
+// true: sum() hands its jobs to the pool.
+// false: sum() creates and joins TN new threads on every call.
+static bool usePool = true;
+
+
+static void *pool_worker(void *data)
+{
+  int id = (int)(intptr_t) data;
+  if (placement != UNPINNED) {
+    pin_thread(pthread_self(), workerCpus[id]);
+  }
+
+  pthread_mutex_lock(&pool.mutex);
+  for (;;) {
+    while (pool.seen[id] == pool.generation && !pool.quit) {
+      pthread_cond_wait(&pool.start, &pool.mutex);
+    }
+    if (pool.quit) {
+      break;
+    }
+    pool.seen[id] = pool.generation;
+    if (id < pool.numJobs) {
+      // Run the job without holding the mutex, so the workers
+      // run in parallel.
+      pthread_mutex_unlock(&pool.mutex);
+      pool.func(&pool.jobs[id]);
+      profile_lock(&profiles[id], &pool.mutex);
+      if (--pool.pending == 0) {
+        pthread_cond_signal(&pool.done);
+      }
     }
   }
-  
-  
+  pthread_mutex_unlock(&pool.mutex);
+  return 0;
+}
+
+
+// Run func(&jobs[i]) for i = 0..TN-1 on the pool's workers, and
+// return when all of them are done.
+static void pool_run(void *(*func)(void *), Job jobs[], int TN)
+{
+  assert(TN <= maxPoolThreads);
+
+  pthread_mutex_lock(&pool.mutex);
+  while (pool.size < TN) {
+    // A new worker has not seen any generation yet, so mark the
+    // current one as seen: it must only pick up the batch below.
+    pool.seen[pool.size] = pool.generation;
+    pthread_create(&pool.threads[pool.size], 0, pool_worker, (void *)(intptr_t) pool.size);
+    pool.size++;
+  }
+  pool.func = func;
+  pool.jobs = jobs;
+  pool.numJobs = TN;
+  pool.pending = TN;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  while (pool.pending > 0) {
+    pthread_cond_wait(&pool.done, &pool.mutex);
+  }
+  pthread_mutex_unlock(&pool.mutex);
+}
+
+
+// Stop and join all the pool's workers.
+static void pool_shutdown()
+{
+  pthread_mutex_lock(&pool.mutex);
+  pool.quit = true;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.mutex);
+
+  for (int i = 0; i < pool.size; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  pool.size = 0;
+  pool.quit = false;
+}
+
+
+// Add up n block sums (and, in KAHAN mode, their compensations)
+// in an order that only depends on n.
+static double combine_blocks(const double *sums, const double *comps, size_t n, Mode mode)
+{
+  double s = 0, c = 0;
+  switch (mode) {
+  case NAIVE:
+    for (size_t k = 0; k < n; k++) {
+      s += sums[k];
+    }
+    return s;
+  case KAHAN:
+    for (size_t k = 0; k < n; k++) {
+      neumaier_add(&s, &c, sums[k]);
+      c += comps[k];
+    }
+    return s + c;
+  case PAIRWISE:
+    if (n == 1) {
+      return sums[0];
+    }
+    return combine_blocks(sums, comps, n / 2, mode) +
+           combine_blocks(sums + n / 2, comps + n / 2, n - n / 2, mode);
+  }
   return 0;
 }
 
 
+// The chunk of A that job i of TN gets in sum(): [*start, *end), made
+// of whole blocks.  The first numBlocks % TN jobs get one more block.
+static void chunk_bounds(size_t n, int TN, int i, size_t *start, size_t *end)
+{
+  size_t numBlocks = (n - 1) / blockSize + 1;
+  size_t blocksPerJob = numBlocks / (size_t) TN;
+  size_t extra = numBlocks % (size_t) TN;
+  size_t j = (size_t) i;
+  size_t first = j * blocksPerJob + (j < extra ? j : extra);
+  size_t last = first + blocksPerJob + (j < extra ? 1 : 0);
+  *start = first * blockSize;
+  *end = last == numBlocks ? n : last * blockSize;
+}
+
+
+// Choose the CPU of each of the TN workers (see topology.h), for
+// sum() calls over A[0..n).
+//
+// sum() is bound by memory bandwidth, and on a machine with several
+// NUMA nodes, reading another node's memory is slower and crosses
+// the link between the packages.  So worker i goes on a CPU of the
+// node that holds the pages of chunk i (the node of its middle
+// page), taking that node's CPUs in the placement's order.  With one
+// node, or if the pages are not placed yet, the workers simply take
+// the CPUs in the placement's order.
+static void place_workers(const double *A, size_t n, int TN)
+{
+  std::vector<int> order = placement_order(placement);
+  std::vector<size_t> nextOnNode((size_t) topology().nodes + 1, 0);
+  for (int i = 0; i < TN; i++) {
+    int cpu = order[(size_t) i % order.size()];
+    size_t start, end;
+    chunk_bounds(n, TN, i, &start, &end);
+    int node = topology().nodes > 1 ? page_node(A + (start + end) / 2) : -1;
+    if (node >= 0 && node < topology().nodes) {
+      std::vector<int> local;
+      for (int c : order) {
+        if (cpu_node(c) == node) {
+          local.push_back(c);
+        }
+      }
+      if (!local.empty()) {
+        cpu = local[nextOnNode[(size_t) node]++ % local.size()];
+      }
+    }
+    workerCpus[i] = cpu;
+  }
+}
+
+
+// An array of doubles for sum(), allocated for speed: in huge pages,
+// and with each chunk's pages on the NUMA node of the worker that
+// will read it.
+//
+// A 4 KB page takes one TLB entry, and the TLB has a few thousand of
+// them, so streaming through 800 MB misses the TLB on every page.  A
+// 2 MB page covers 512 times as much.  We ask mmap() for explicit huge
+// pages (MAP_HUGETLB) first; those have to be reserved beforehand in
+// /proc/sys/vm/nr_hugepages, so if there are not enough, we map
+// normal pages and ask for transparent huge pages with madvise().
+//
+// The kernel puts a page on the node of the thread that first
+// writes it.  Filling the array in a loop in main() would put all of
+// it on main()'s node, so instead each chunk (as sum() cuts them,
+// see chunk_bounds()) is filled by its own thread, on the CPU that
+// sum()'s worker for that chunk will run on.
+struct BigArray
+{
+  double *data;
+  size_t bytes;   // size of the mapping
+  bool hugetlb;   // true: explicit huge pages; false: madvise(MADV_HUGEPAGE)
+};
+
+const size_t hugePageSize = 2 << 20;
+
+struct FillJob
+{
+  double *A;
+  size_t start;
+  size_t end;
+};
+
+static void *fill_thread(void *data)
+{
+  FillJob *job = (FillJob *) data;
+  for (size_t i = job->start; i < job->end; i++) {
+    job->A[i] = (double) i;
+  }
+  return 0;
+}
+
+// Allocate length doubles and set A[i] = i, with TN threads.  With a
+// placement, also chooses workerCpus[] (see place_workers()).
+static BigArray alloc_array(size_t length, int TN)
+{
+  BigArray a;
+  a.bytes = (length * sizeof(double) + hugePageSize - 1) / hugePageSize * hugePageSize;
+  a.hugetlb = true;
+  void *p = mmap(0, a.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) {
+    a.hugetlb = false;
+    p = mmap(0, a.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    madvise(p, a.bytes, MADV_HUGEPAGE);
+  }
+  a.data = (double *) p;
+
+  // No page has been touched yet, so this only picks the CPUs
+  if (placement != UNPINNED) {
+    place_workers(a.data, length, TN);
+  }
+  // The threads are pinned before they start: a page they touched
+  // before being moved would stay where it was touched.
+  pthread_t threads[TN];
+  FillJob jobs[TN];
+  for (int i = 0; i < TN; i++) {
+    jobs[i].A = a.data;
+    chunk_bounds(length, TN, i, &jobs[i].start, &jobs[i].end);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (placement != UNPINNED) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(workerCpus[i], &set);
+      pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    pthread_create(&threads[i], &attr, fill_thread, &jobs[i]);
+    pthread_attr_destroy(&attr);
+  }
+  for (int i = 0; i < TN; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return a;
+}
+
+static void free_array(BigArray *a)
+{
+  munmap(a->data, a->bytes);
+  a->data = 0;
+}
+
+
 // This function sums up n elements in array A using TN threads
 // returns the sum as a double
-double sum(double A[], int n, int TN)
+double sum(double A[], size_t n, int TN, Mode mode)
 {
   assert(n > 0);
-  assert(TN > 0);
+  assert(TN > 0 && TN <= maxPoolThreads);
   
   pthread_t threads[TN];  // create TN number of threads
   Job jobs[TN];           // create TN number of jobs, each job is passed into a thread
 
-  int sliceLength = 20;
-  int sliceStep = sliceLength * TN;
+  size_t numBlocks = (n - 1) / blockSize + 1;
+  double *blockSums = new double[numBlocks];
+  double *blockComps = new double[numBlocks];
 
-  // find the last element in array A
-  double b;
-  for (int i = 0; i < n; i++) {
-    b = A[i];
-  }
-  
+  // Every element costs the same to add, so each job simply gets
+  // one contiguous chunk of about n/TN elements.  Contiguous chunks
+  // let each thread stream through memory with the hardware
+  // prefetcher's help.
+  //
+  // The chunks are made of whole blocks.  A block is 32 KB, so if A
+  // starts on a 64-byte cache line, so does every chunk: two threads'
+  // chunks never share a line, which would make both cores need it.
   for (int i=0; i < TN; ++i) {
-  
-    // TODO: add code here
-    // Here you have array A, containing n elements.
-    // You need to divide the n elements among TN jobs.
-    // Each job calculates the sum of array elements from a start to
-    // an end index. For each job jobs[i], you need to set the
-    // approprite values for the variables in the Job struct, such as
-    // the start and end indices.
-    jobs[i].start = sliceLength * i;
-    jobs[i].sliceLength = sliceLength;
-    jobs[i].sliceStep = sliceStep;
-    jobs[i].end = b + 1;
-    
+    jobs[i].A = A;
+    chunk_bounds(n, TN, i, &jobs[i].start, &jobs[i].end);
+    jobs[i].mode = mode;
+    jobs[i].blockSums = blockSums;
+    jobs[i].blockComps = blockComps;
+    jobs[i].profile = &profiles[i];
+  }
+
+  if (usePool) {
+    pool_run(sum_thread, jobs, TN);
+  } else {
     // launch thread with parameter jobs[i]
-    pthread_create(&threads[i], 0, sum_thread, &jobs[i]);
+    for (int i=0; i < TN; ++i) {
+      pthread_create(&threads[i], 0, sum_thread, &jobs[i]);
+      if (placement != UNPINNED) {
+        pin_thread(threads[i], workerCpus[i]);
+      }
+    }
+
+    // Wait for threads to complete (join),
+    // After all threads complete, add up partial sums to sum
+    for (int i=0; i < TN; ++i) {
+      pthread_join( threads[i], NULL);
+    }
   }
 
-  // Wait for threads to complete (join),
-  // After all threads complete, add up partial sums to sum
-  double sum = 0;
-  for (int i=0; i < TN; ++i) {
-    // TODO: add code here
-    pthread_join( threads[i], NULL);
+  double sum = combine_blocks(blockSums, blockComps, numBlocks, mode);
+  delete [] blockSums;
+  delete [] blockComps;
+  return sum;
+}
+
+
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+
+// Time `calls` calls of sum() with and without the thread pool, and
+// in each summation mode, and print the average time of one call.
+static void benchmark(double A[], size_t length, int TN, int calls)
+{
+  const char *names[2] = { "create/join", "pool" };
+
+  for (int p = 0; p < 2; p++) {
+    for (int m = NAIVE; m <= PAIRWISE; m++) {
+      usePool = p == 1;
+      sum(A, length, TN, (Mode) m);  // warm up (and start the pool)
+      double t = now();
+      for (int i = 0; i < calls; i++) {
+        sum(A, length, TN, (Mode) m);
+      }
+      t = now() - t;
+      printf("%-12s %-8s length=%zu TN=%d: %10.2f us per call\n",
+             names[p], modeNames[m], length, TN, t / calls * 1e6);
+    }
+  }
+}
+
+
+// Count the calling thread's data TLB load misses, and those of the
+// threads it creates from now on (they are added in when they are
+// joined).  Returns -1 if the kernel does not let us.
+static int open_tlb_counter()
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.inherit = 1;
+  return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Compare alloc_array() with what main() used to do: posix_memalign()
+// in 4 KB pages, filled by main() alone.  For each, print how long
+// the fill took, and per call of sum(): the time, the bandwidth, and
+// the data TLB misses.  The pool is restarted for each, so that its
+// workers are counted, and so that with a placement they are pinned
+// for the new array.
+static void alloc_benchmark(size_t length, int TN, int calls)
+{
+  size_t bytes = length * sizeof(double);
+  printf("length=%zu (%.0f MB) TN=%d placement=%s, %d calls:\n", length, (double) bytes / 1e6,
+         TN, placementNames[placement], calls);
+  for (int huge = 0; huge < 2; huge++) {
+    double t = now();
+    BigArray big = { 0, 0, false };
+    double *A;
+    if (huge) {
+      big = alloc_array(length, TN);
+      A = big.data;
+    } else {
+      if (posix_memalign((void **) &A, hugePageSize, bytes)) {
+        perror("posix_memalign");
+        exit(1);
+      }
+      madvise(A, bytes, MADV_NOHUGEPAGE);
+      for (size_t i = 0; i < length; i++) {
+        A[i] = (double) i;
+      }
+    }
+    double fill = now() - t;
+    if (placement != UNPINNED) {
+      place_workers(A, length, TN);
+    }
+
+    pool_shutdown();
+    int fd = open_tlb_counter();
+    sum(A, length, TN, NAIVE);  // warm up, and start the pool
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    }
+    t = now();
+    for (int i = 0; i < calls; i++) {
+      sum(A, length, TN, NAIVE);
+    }
+    t = now() - t;
+    pool_shutdown();
+    long long misses = -1;
+    if (fd >= 0 && read(fd, &misses, sizeof(misses)) != (ssize_t) sizeof(misses)) {
+      misses = -1;
+    }
+
+    printf("  %-28s fill %8.1f ms   sum %8.2f ms/call  %6.2f GB/s", 
+           huge ? (big.hugetlb ? "huge (MAP_HUGETLB), parallel" : "huge (THP), parallel")
+                : "4 KB pages, serial fill", fill * 1e3, t / calls * 1e3,
+           (double) bytes * calls / t / 1e9);
+    if (misses >= 0) {
+      printf("  %12.0f dTLB misses/call\n", (double) misses / calls);
+    } else {
+      printf("  (no dTLB counter)\n");
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (huge) {
+      free_array(&big);
+    } else {
+      free(A);
+    }
+  }
+}
+
+
+// Sum a file of doubles (raw, in this machine's byte order) that may
+// be much larger than memory.
+//
+// The file is read in blocks of streamBlockBytes into two buffers in
+// turn: a reader thread fills one while sum() reduces the other with
+// the pool, so the disk and the cores work at the same time, and the
+// whole run takes as long as the slower of the two.  Summing is a few
+// GB/s per core, so that is the disk.
+//
+// The reads use O_DIRECT: the disk writes straight into our buffers,
+// instead of into the page cache and then, with a copy, into ours.
+// The file is read once, so caching it would only cost the copy and
+// evict everything else.  O_DIRECT needs the buffer, the file offset
+// and the length aligned to the device's block size; the buffers
+// start on a huge page and the blocks are a multiple of it, so only
+// the last read of the file is short.  File systems that refuse
+// O_DIRECT (tmpfs) are read normally.
+//
+// The buffers come from alloc_array(), so they are in huge pages and
+// each chunk is on the NUMA node of the worker that sums it.
+const size_t streamBlockBytes = 64 << 20;
+
+struct Stream
+{
+  int fd;
+  BigArray buffers[2];
+  size_t bytes[2];        // bytes read into each buffer, 0 at the end of the file
+  bool full[2];           // true: the reader filled it, sum() has not reduced it yet
+  int error;              // errno of a failed read, or 0
+  double readerWait;      // seconds the reader waited for an empty buffer
+  double sumWait;         // seconds sum() waited for a full buffer
+  pthread_mutex_t mutex;  // protects bytes, full, error and the waits
+  pthread_cond_t changed; // signalled when a buffer is filled or emptied
+};
+
+// Read the whole file into stream->buffers[0, 1, 0, 1, ...], and end
+// with a buffer of 0 bytes
+static void *read_thread(void *data)
+{
+  Stream *stream = (Stream *) data;
+  for (int k = 0; ; k ^= 1) {
+    pthread_mutex_lock(&stream->mutex);
+    double t = now();
+    while (stream->full[k]) {
+      pthread_cond_wait(&stream->changed, &stream->mutex);
+    }
+    stream->readerWait += now() - t;
+    pthread_mutex_unlock(&stream->mutex);
+
+    char *buffer = (char *) stream->buffers[k].data;
+    size_t got = 0;
+    int error = 0;
+    while (got < streamBlockBytes) {
+      ssize_t r = read(stream->fd, buffer + got, streamBlockBytes - got);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r < 0) {
+        error = errno;
+        break;
+      }
+      if (r == 0) {
+        break;
+      }
+      got += (size_t) r;
+    }
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->bytes[k] = error ? 0 : got;
+    stream->error = error;
+    stream->full[k] = true;
+    pthread_cond_signal(&stream->changed);
+    pthread_mutex_unlock(&stream->mutex);
+    if (error || got == 0) {
+      return 0;
+    }
+  }
+}
+
+// Sum the doubles in file with TN threads, and print the result and
+// how fast the file was read
+static void stream_sum(const char *file, int TN, Mode mode)
+{
+  Stream stream;
+  bool direct = true;
+  stream.fd = open(file, O_RDONLY | O_DIRECT);
+  if (stream.fd < 0 && errno == EINVAL) {
+    direct = false;
+    stream.fd = open(file, O_RDONLY);
+  }
+  if (stream.fd < 0) {
+    perror(file);
+    exit(1);
+  }
+  if (!direct) {
+    posix_fadvise(stream.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  struct stat st;
+  if (fstat(stream.fd, &st) == 0 && st.st_size % (off_t) sizeof(double)) {
+    fprintf(stderr, "%s: ignoring the last %d bytes, which are not a whole double\n", file,
+            (int) (st.st_size % (off_t) sizeof(double)));
   }
 
+  for (int k = 0; k < 2; k++) {
+    stream.buffers[k] = alloc_array(streamBlockBytes / sizeof(double), TN);
+    stream.bytes[k] = 0;
+    stream.full[k] = false;
+  }
+  if (placement != UNPINNED) {
+    place_workers(stream.buffers[0].data, streamBlockBytes / sizeof(double), TN);
+  }
+  stream.error = 0;
+  stream.readerWait = 0;
+  stream.sumWait = 0;
+  pthread_mutex_init(&stream.mutex, 0);
+  pthread_cond_init(&stream.changed, 0);
+
+  double start = now();
+  pthread_t reader;
+  pthread_create(&reader, 0, read_thread, &stream);
+
+  // The buffer sums are added like the block sums in combine_blocks()
+  double s = 0, c = 0;
+  uint64_t count = 0;
+  for (int k = 0; ; k ^= 1) {
+    pthread_mutex_lock(&stream.mutex);
+    double t = now();
+    while (!stream.full[k]) {
+      pthread_cond_wait(&stream.changed, &stream.mutex);
+    }
+    stream.sumWait += now() - t;
+    size_t n = stream.bytes[k] / sizeof(double);
+    pthread_mutex_unlock(&stream.mutex);
+    if (n == 0) {
+      break;
+    }
+
+    double x = sum(stream.buffers[k].data, n, TN, mode);
+    if (mode == NAIVE) {
+      s += x;
+    } else {
+      neumaier_add(&s, &c, x);
+    }
+    count += n;
+
+    pthread_mutex_lock(&stream.mutex);
+    stream.full[k] = false;
+    pthread_cond_signal(&stream.changed);
+    pthread_mutex_unlock(&stream.mutex);
+  }
+  pthread_join(reader, NULL);
+  double t = now() - start;
+  if (stream.error) {
+    errno = stream.error;
+    perror(file);
+    exit(1);
+  }
+
+  printf("Result = %f\n", s + c);
+  double bytes = (double) count * sizeof(double);
+  printf("%llu doubles (%.2f GB) in %.2f s: %.2f GB/s, %s; sum() waited %.2f s for the reader, "
+         "the reader %.2f s for sum()\n", (unsigned long long) count, bytes / 1e9, t,
+         bytes / t / 1e9, direct ? "O_DIRECT" : "page cache", stream.sumWait, stream.readerWait);
+
+  close(stream.fd);
+  pthread_mutex_destroy(&stream.mutex);
+  pthread_cond_destroy(&stream.changed);
+  for (int k = 0; k < 2; k++) {
+    free_array(&stream.buffers[k]);
+  }
+}
+
+// Write a file for -f: length doubles, with A[i] = i like main()'s array
+static void write_array_file(const char *file, size_t length)
+{
+  FILE *f = fopen(file, "wb");
+  if (!f) {
+    perror(file);
+    exit(1);
+  }
+  const size_t chunk = 1 << 20;
+  double *buffer = new double[chunk];
+  for (size_t i = 0; i < length; i += chunk) {
+    size_t n = length - i < chunk ? length - i : chunk;
+    for (size_t j = 0; j < n; j++) {
+      buffer[j] = (double) (i + j);
+    }
+    if (fwrite(buffer, sizeof(double), n, f) != n) {
+      perror(file);
+      exit(1);
+    }
+  }
+  delete [] buffer;
+  if (fclose(f)) {
+    perror(file);
+    exit(1);
+  }
+}
+
+
+// Microbenchmark for false sharing.
+//
+// Each of TN threads adds 1.0 to its own counter, `iters` times.
+//  - "packed": the counters are adjacent doubles in one array, and
+//    are updated in memory, like the first version of sum_thread
+//    did with job->res.  Eight counters share a cache line, so the
+//    line bounces between the cores on every write.
+//  - "padded": the same, but every counter is on its own cache line.
+//  - "register": the counter is a local variable and is written to
+//    the array once at the end, which is what sum_thread does now.
+struct PackedCounter
+{
+  volatile double res;  // volatile: make the compiler store every update
+};
+
+struct alignas(64) PaddedCounter
+{
+  volatile double res;
+};
+
+template <typename Counter>
+static void *count_thread(void *data)
+{
+  Counter *c = (Counter *) data;
+  for (int i = 0; i < 10000000; i++) {
+    c->res = c->res + 1.0;
+  }
+  return 0;
+}
+
+static void *count_thread_register(void *data)
+{
+  PackedCounter *c = (PackedCounter *) data;
+  double res = 0;
+  for (int i = 0; i < 10000000; i++) {
+    res += 1.0;
+    __asm__ volatile("" : "+x"(res));  // keep the loop from being folded away
+  }
+  c->res = res;
+  return 0;
+}
+
+template <typename Counter>
+static double time_counters(void *(*func)(void *), int TN)
+{
+  pthread_t threads[TN];
+  Counter counters[TN];
+
+  double t = now();
+  for (int i = 0; i < TN; i++) {
+    counters[i].res = 0;
+    pthread_create(&threads[i], 0, func, &counters[i]);
+  }
   for (int i = 0; i < TN; i++) {
-    sum += jobs[i].res;
+    pthread_join(threads[i], NULL);
   }
+  return now() - t;
+}
 
-  return sum;
+static void sharing_benchmark(int TN)
+{
+  printf("false sharing, %d threads x 10^7 updates:\n", TN);
+  printf("  packed   %8.2f ms\n", time_counters<PackedCounter>(count_thread<PackedCounter>, TN) * 1e3);
+  printf("  padded   %8.2f ms\n", time_counters<PaddedCounter>(count_thread<PaddedCounter>, TN) * 1e3);
+  printf("  register %8.2f ms\n", time_counters<PackedCounter>(count_thread_register, TN) * 1e3);
 }
 
 
+static void usage(const char *prog)
+{
+  printf("usage: %s [-m naive|kahan|pairwise] [-s | -b | -H] [-a placement] array-length [threads]\n"
+         "       %s [-m naive|kahan|pairwise] [-a placement] -f file [threads]\n"
+         "       %s -g file array-length\n"
+         "  threads defaults to one per physical core (%d here)\n"
+         "  -m  how to accumulate the elements (default: naive)\n"
+         "  -s  create and join new threads on every call, instead of\n"
+         "      using a pool of threads that lives for the whole run\n"
+         "  -b  benchmark: print the time per call with and without the pool,\n"
+         "      and the cost of false sharing between the threads' results\n"
+         "  -a  pin the threads: compact (fill each core's SMT threads\n"
+         "      first), scatter (one per core first), or none (default).\n"
+         "      Each thread goes on the NUMA node that holds its chunk.\n"
+         "  -H  compare the array in huge pages, filled by the threads that\n"
+         "      sum it, with 4 KB pages filled by main(): time, bandwidth\n"
+         "      and TLB misses of sum()\n"
+         "  -f  sum the doubles in file instead, reading it while summing;\n"
+         "      it can be larger than memory\n"
+         "  -g  write a file for -f with array-length doubles, A[i] = i\n",
+         prog, prog, prog, default_threads());
+  exit(1);
+}
+
 
 int main(int argc, char *argv[])
 {
-  if (argc != 3) {
-    printf("usage: %s array-length threads\n", argv[0]);
-    exit(1);
+  const char *prog = argv[0];
+  bool bench = false;
+  bool allocBench = false;
+  const char *streamFile = 0;
+  const char *genFile = 0;
+  Mode mode = NAIVE;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:sba:Hf:g:")) != -1) {
+    if (opt == 'm') {
+      int m = NAIVE;
+      while (m <= PAIRWISE && strcasecmp(optarg, modeNames[m])) {
+        m++;
+      }
+      if (m > PAIRWISE) {
+        usage(prog);
+      }
+      mode = (Mode) m;
+    } else if (opt == 's') {
+      usePool = false;
+    } else if (opt == 'b') {
+      bench = true;
+    } else if (opt == 'H') {
+      allocBench = true;
+    } else if (opt == 'f') {
+      streamFile = optarg;
+    } else if (opt == 'g') {
+      genFile = optarg;
+    } else if (opt == 'a') {
+      if (!parse_placement(optarg, &placement)) {
+        usage(prog);
+      }
+    } else {
+      usage(prog);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (streamFile) {
+    if (argc > 2) {
+      usage(prog);
+    }
+    int TN = argc == 2 ? atoi(argv[1]) : default_threads();
+    assert(TN > 0 && TN <= maxPoolThreads);
+    stream_sum(streamFile, TN, mode);
+    profile_report("sum_thread, over the whole file", profiles, TN);
+    pool_shutdown();
+    return 0;
+  }
+  if (genFile) {
+    if (argc != 2) {
+      usage(prog);
+    }
+    write_array_file(genFile, strtoull(argv[1], 0, 10));
+    return 0;
+  }
+
+  if (argc != 2 && argc != 3) {
+    usage(prog);
   }
 
-  int length = 100000;
+  size_t length = 100000;
   int TN = 1;
 
-  length = atoi(argv[1]);
-  TN = atoi(argv[2]);
+  length = strtoull(argv[1], 0, 10);
+  TN = argc == 3 ? atoi(argv[2]) : default_threads();
 
   assert(length >= 1);
-  assert(TN > 0);
+  assert(TN > 0 && TN <= maxPoolThreads);
   
-  // create and initialize array of doubles
-  double *A = new double[length];
-  int count = 0;
-  for (int i=0; i < length; ++i) {
-    A[i] = count++;
+  if (allocBench) {
+    alloc_benchmark(length, TN, 20);
+    return 0;
+  }
+
+  // create and initialize array of doubles, with A[i] = i.  It starts
+  // on a page, so that the threads' chunks start on a cache line (see
+  // sum()).  Now that the pages are placed, choose the workers' CPUs
+  // again from where they actually are.
+  BigArray big = alloc_array(length, TN);
+  double *A = big.data;
+  if (placement != UNPINNED) {
+    place_workers(A, length, TN);
+  }
+
+  if (bench) {
+    benchmark(A, length, TN, 1000);
+    sharing_benchmark(TN);
+    pool_shutdown();
+    free_array(&big);
+    return 0;
   }
 
   // calculate sum of array using sum() function
   double result;
   for (int i=0; i < 1000; ++i) {
-    result = sum(A, length, TN);
+    result = sum(A, length, TN, mode);
   }
   
   printf("Result = %f\n", result);
-  delete [] A;
+  profile_report("sum_thread, over 1000 calls", profiles, TN);
+  pool_shutdown();
+  free_array(&big);
   
   return 0;
 }
 
 /*
-  Copy and paste the output of the test results here:
+  Copy and paste the output of the test results here (make bench, at
+  the top of the tree, times every mode and thread count in bench.csv;
+  see scaling.c):
   time ./sum 4000000 1
   Result = 7999998000000.000000
 
@@ -1,38 +1,218 @@
 // count primes in a given interval in parallel
 
 #include <pthread.h>
+#include <fcntl.h>
 #include <cassert>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "instrument.h"
+#include "topology.h"
 
 // uint4 - unsigned 4-byte int
 // Shorter to type than "unsigned int"
 typedef unsigned int uint4;
 
-pthread_mutex_t largestPrimeMutex = PTHREAD_MUTEX_INITIALIZER;
-uint4 largestPrime = 0;
+// uint8 - unsigned 8-byte int.  Ranges that go past 2^32 are
+// checked with uint8 instead of uint4; see num_primes().
+typedef unsigned long long uint8;
+
+// How prime_thread decides which integers in its slices are prime.
+//  - TRIAL calls is_prime() on every integer, i.e. trial division
+//    by every odd number up to the square root.
+//  - SIEVE crosses off the multiples of the base primes in each
+//    slice (segmented Sieve of Eratosthenes), and counts what is left.
+//  - MILLER_RABIN calls is_prime_mr() on every integer, which costs
+//    about the same for every x, no matter how large.
+//  - PI only counts the primes, as pi(b) - pi(a-1) (see prime_pi()),
+//    without looking at the integers in between.  Only the smallest
+//    and largest prime are found, by checking small windows at the
+//    ends of the range; twin pairs and gaps are not counted.
+//  - AUTO lets num_primes() pick one of the above but PI; see
+//    choose_mode().
+enum Mode { TRIAL, SIEVE, MILLER_RABIN, PI, AUTO };
+const char *modeNames[] = { "trial", "sieve", "mr", "pi", "auto" };
+
+// Where num_primes() puts its threads; see topology.h
+Placement placement = UNPINNED;
+
+// The odd primes up to sqrt(b), used by the SIEVE mode.  They are
+// computed once by num_primes() before any thread starts, and then
+// only read by the threads, so no mutex is needed.
+uint4 *basePrimes = 0;
+uint4 numBasePrimes = 0;
+
+// For each base prime p, when b < 2^32 and the mode is TRIAL:
+// p^-1 mod 2^32, and (2^32-1) / p.  See find_base_inverses().
+uint4 *basePrimeInverses = 0;
+uint4 *basePrimeLimits = 0;
+
+// The sieve needs every prime up to sqrt(b).  Past 2^26 (i.e. b past
+// 2^52) that list alone takes more memory and time than testing the
+// integers one by one, so choose_mode() switches to Miller-Rabin.
+const uint4 maxSieveRoot = 1 << 26;
+
+// Number of bits in the sieve bit array of one slice.  Only odd
+// numbers get a bit, so a slice covers 2*sieveBits integers.
+// 2^18 bits is 32 KB, which fits in the L1 data cache of the lab
+// machines: crossing off multiples never has to go out to memory.
+const uint4 sieveBits = 1 << 18;
+
+// What we found out about the primes in a range of integers.
+//
+// Each thread fills in one Summary per chunk of slices it checks,
+// without talking to the other threads.  Since a Summary knows its
+// first and last prime, the Summaries of neighbouring ranges can be
+// merged afterwards (see append()) as if the whole range had been
+// checked in one go: a twin pair or a gap that straddles the border
+// between two chunks is found when the chunks are merged.
+template <typename T>
+struct Summary
+{
+  T count;    // number of primes
+  T first;    // smallest prime (if count > 0)
+  T last;     // largest prime (if count > 0)
+  T twins;    // number of twin primes: pairs p, p+2 that are both in the range
+  T maxGap;   // largest difference between two consecutive primes in the range
+
+  Summary() : count(0), first(0), last(0), twins(0), maxGap(0) {}
+
+  // Add a prime p, which must be larger than all the primes added so far
+  void add(T p)
+  {
+    if( count == 0 ) {
+      first = p;
+    } else {
+      T gap = p - last;
+      twins += gap == 2;
+      maxGap = std::max(maxGap, gap);
+    }
+    last = p;
+    count++;
+  }
+
+  // Add the primes of the range right after this one
+  void append(const Summary &next)
+  {
+    if( next.count == 0 ) {
+      return;
+    }
+    if( count == 0 ) {
+      *this = next;
+      return;
+    }
+    T gap = next.first - last;
+    twins += next.twins + (gap == 2);
+    maxGap = std::max(std::max(maxGap, next.maxGap), gap);
+    last = next.last;
+    count += next.count;
+  }
+};
+
+// The Summary of the slices [firstSlice, firstSlice + n), for some n
+template <typename T>
+struct Chunk
+{
+  T firstSlice;
+  Summary<T> summary;
+
+  bool operator<(const Chunk &other) const
+  {
+    return firstSlice < other.firstSlice;
+  }
+};
+
+
+// The slices a thread still has to check, as the range of slice
+// numbers [head, tail) (slice k is [a + k*sliceLength, ...]).
+//
+// Each thread has one, and takes work from the head of its own
+// queue.  A thread whose queue is empty steals the upper half of
+// another thread's queue, from the tail.  Either end can be moved
+// by two threads at once, so every queue has its own mutex; they
+// are only held for a few instructions.
+//
+// The queues are kept in an array, one per thread.  alignas(64) puts
+// each one on its own cache line: otherwise locking one thread's
+// mutex would also take the line holding its neighbour's queue away
+// from the neighbour's core ("false sharing").
+template <typename T>
+struct alignas(64) WorkQueue
+{
+  pthread_mutex_t mutex;
+  T head;
+  T tail;
+};
+
 
 // a Job is a struct that represents the work that a thread
 // needs to do.  In this case, it must describe what integers
 // this thread needs to check.  It will also include the
-// result - the number of primes that the thread found.
-struct Job
+// result - a Summary of every chunk of slices the thread checked.
+//
+// T is the integer type of the range: uint4 when b < 2^32, uint8
+// otherwise.  32-bit division is several times faster than 64-bit
+// division, so we only pay for the wide type when we need it.
+//
+// Like the WorkQueues, each Job gets its own cache line.  The thread
+// builds each chunk's Summary in a local variable and only appends
+// it to chunks when the chunk is done, but the jobs are read by the
+// stealing threads.
+template <typename T>
+struct alignas(64) Job
 {
   // We will divide the range [a,b] into a large number of slices,
   // and each job will handle several slices.
   // see num_primes() for more details.
   //
-  uint4 start;       // Start of this job's first slice
-  uint4 end;         // Every job has the same end: b+1
-  uint4 sliceLength; // Length of each slice
-  uint4 sliceStep;   // When a slice is done, jump forward sliceStep = tn * sliceLength
-  uint4 res;         // Store result here: sum of primes in all slices this thread examined
+  // The last slice is kept as an inclusive bound: b+1 does not fit
+  // in T when b is the largest T, and would wrap around to 0.
+  //
+  int   id;          // Index of this job's own queue in queues[]
+  int   tn;          // Number of jobs, and of queues
+  WorkQueue<T> *queues; // Every job's queue of slices, shared by all jobs
+  T     a;           // Start of slice 0
+  T     last;        // Every job has the same last integer: b
+  T     sliceLength; // Length of each slice
+  std::vector< Chunk<T> > chunks; // Store result here: what we found in each chunk of slices
+  Mode  mode;        // Trial division, segmented sieve or Miller-Rabin
+  ThreadProfile *profile; // see instrument.h
 };
 
 
+// return the largest integer r with r*r <= x
+uint4 isqrt(uint8 x)
+{
+  uint8 r = (uint8)sqrt((double)x);
+  // sqrt() on a double can be off by one for large x (and can
+  // even round up to 2^32); fix it up.
+  if( r > 0xFFFFFFFFULL ) {
+    r = 0xFFFFFFFFULL;
+  }
+  while( r * r > x ) {
+    r--;
+  }
+  while( r < 0xFFFFFFFFULL && (r+1) * (r+1) <= x ) {
+    r++;
+  }
+  return (uint4)r;
+}
+
+
 // return true iff x is a prime number
-bool is_prime(uint4 x)
+template <typename T>
+bool is_prime(T x)
 {
   if( x == 2 ) {
     return true;
@@ -48,11 +228,11 @@ bool is_prime(uint4 x)
     return true;
   }
 
-  int root = (int)sqrt(x) + 1; // Largest number that could divide x
+  T root = isqrt(x); // Largest number that could divide x
 
   // Check all odd numbers between 3 and root, inclusive,
   // to see if x is divisible by that number
-  int d = 3;
+  T d = 3;
   while( ( d <= root ) && (x % d != 0 ) ) {
     d += 2;
   }
@@ -66,62 +246,1024 @@ bool is_prime(uint4 x)
 
 
 
+// Montgomery arithmetic modulo an odd n.
+//
+// Computing x*y % n needs a 128-bit division, which is slow.  In
+// Montgomery form a number x is stored as x*R % n, with R = 2^64, and
+// the product of two such numbers can be brought back into Montgomery
+// form with two multiplications and a shift instead (see reduce()).
+// Converting in and out costs a little, but a modular exponentiation
+// does 64 multiplications in a row, all of them in Montgomery form.
+struct Montgomery
+{
+  uint8 n;     // the (odd) modulus
+  uint8 ninv;  // n^-1 mod 2^64
+  uint8 r2;    // R^2 mod n, used to convert into Montgomery form
+  uint8 one;   // 1 in Montgomery form, i.e. R mod n
+
+  Montgomery(uint8 n_) : n(n_)
+  {
+    // Newton's iteration: every step doubles the number of
+    // correct low bits of the inverse, and n is its own inverse
+    // mod 2^3 for odd n, so 5 steps give all 64 bits.
+    ninv = n;
+    for( int i = 0; i < 5; i++ ) {
+      ninv *= 2 - n * ninv;
+    }
+    one = (0 - n) % n;
+    r2 = (uint8)((unsigned __int128)one * one % n);
+  }
+
+  // return t / R mod n, for t < n*R
+  uint8 reduce(unsigned __int128 t) const
+  {
+    uint8 m = (uint8)t * ninv;  // m*n == t mod R, so t - m*n is a multiple of R
+    uint8 hi = (uint8)(t >> 64);
+    uint8 mn = (uint8)(((unsigned __int128)m * n) >> 64);
+    return hi >= mn ? hi - mn : hi - mn + n;
+  }
+
+  uint8 mul(uint8 x, uint8 y) const
+  {
+    return reduce((unsigned __int128)x * y);
+  }
+
+  uint8 to_mont(uint8 x) const
+  {
+    return mul(x % n, r2);
+  }
+
+  // return x^e, with x and the result in Montgomery form
+  uint8 pow(uint8 x, uint8 e) const
+  {
+    uint8 r = one;
+    while( e ) {
+      if( e & 1 ) {
+        r = mul(r, x);
+      }
+      x = mul(x, x);
+      e >>= 1;
+    }
+    return r;
+  }
+};
+
+
+// return true iff x is a prime number, using the Miller-Rabin test.
+//
+// Miller-Rabin is normally a probabilistic test, but for every
+// x < 2^64 it is known which "witnesses" are enough to catch all
+// composites, so with those the answer is exact:
+//  - x < 4,759,123,141: the witnesses 2, 7 and 61 (Jaeschke)
+//  - x < 2^64: the 7 witnesses below (Jim Sinclair)
+bool is_prime_mr(uint8 x)
+{
+  static const uint4 smallPrimes[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+  static const uint8 witnesses32[] = { 2, 7, 61 };
+  static const uint8 witnesses64[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+
+  if( x < 2 ) {
+    return false;
+  }
+  // Most composites have a small factor; finding it is much
+  // cheaper than a round of Miller-Rabin.
+  for( uint4 p : smallPrimes ) {
+    if( x % p == 0 ) {
+      return x == p;
+    }
+  }
+  if( x < 37 * 37 ) {
+    return true;
+  }
+
+  // write x-1 = d * 2^s with d odd
+  uint8 d = x - 1;
+  int s = __builtin_ctzll(d);
+  d >>= s;
+
+  Montgomery m(x);
+  uint8 minusOne = x - m.one;  // x-1 in Montgomery form
+  const uint8 *w = x < 4759123141ULL ? witnesses32 : witnesses64;
+  int numWitnesses = x < 4759123141ULL ? 3 : 7;
+
+  for( int k = 0; k < numWitnesses; k++ ) {
+    uint8 a = w[k] % x;
+    if( a == 0 ) {
+      continue;
+    }
+    // x is a "strong probable prime" to base a if a^d == 1, or
+    // a^(d * 2^r) == -1 for some 0 <= r < s.
+    uint8 y = m.pow(m.to_mont(a), d);
+    if( y == m.one || y == minusOne ) {
+      continue;
+    }
+    int r;
+    for( r = 1; r < s; r++ ) {
+      y = m.mul(y, y);
+      if( y == minusOne ) {
+        break;
+      }
+    }
+    if( r == s ) {
+      return false;  // a is a witness that x is composite
+    }
+  }
+  return true;
+}
+
+
+// Fill basePrimes[] with the odd primes <= limit, using the plain
+// (unsegmented) Sieve of Eratosthenes.  limit is at most 65535
+// when b < 2^32, so this usually takes no measurable time.
+void find_base_primes(uint4 limit)
+{
+  bool *composite = new bool[limit + 1];
+  memset(composite, 0, limit + 1);
+
+  delete [] basePrimes;
+  basePrimes = new uint4[limit / 2 + 1];
+  numBasePrimes = 0;
+
+  for( uint4 p = 3; p <= limit; p += 2 ) {
+    if( !composite[p] ) {
+      basePrimes[numBasePrimes++] = p;
+      for( uint8 m = (uint8)p * p; m <= limit; m += 2 * p ) {
+        composite[m] = true;
+      }
+    }
+  }
+  delete [] composite;
+}
+
+
+// Fill basePrimeInverses[] and basePrimeLimits[] for the base primes.
+//
+// For an odd p, multiplying by p^-1 mod 2^32 maps the multiples of p
+// below 2^32, 0, p, 2p, ..., onto 0, 1, 2, ..., (2^32-1) / p, and every
+// other x onto something larger (Granlund and Montgomery).  So x is
+// divisible by p iff x * p^-1 mod 2^32 <= (2^32-1) / p: one
+// multiplication and one comparison, instead of a division.
+void find_base_inverses()
+{
+  delete [] basePrimeInverses;
+  delete [] basePrimeLimits;
+  basePrimeInverses = new uint4[numBasePrimes];
+  basePrimeLimits = new uint4[numBasePrimes];
+  for( uint4 k = 0; k < numBasePrimes; k++ ) {
+    uint4 p = basePrimes[k];
+    // Newton's iteration, as in Montgomery: 3 correct bits, then 6,
+    // 12, 24, 48
+    uint4 inv = p;
+    for( int i = 0; i < 4; i++ ) {
+      inv *= 2 - p * inv;
+    }
+    basePrimeInverses[k] = inv;
+    basePrimeLimits[k] = 0xFFFFFFFFU / p;
+  }
+}
+
+
+// Batched trial division: set prime[i] to is_prime(x[i]), for i < n.
+//
+// The uint4 version checks the whole batch against one base prime at
+// a time (see find_base_inverses()), 8 candidates per AVX2
+// instruction.  A candidate drops out once a divisor is found, and a
+// group of 8 stops as soon as all of them have.  Only the base primes
+// are tried, not every odd number like is_prime() does.  The
+// base primes must reach the square root of every x[i].
+//
+// Like sum.c's kernels, the AVX2 version is compiled with the target
+// attribute, and pick_batch_kernel() chooses it at run time if the
+// CPU supports it.  Otherwise, and for uint8 (AVX2 has no 64-bit
+// multiply), the batch falls back to is_prime() on each x.
+static void is_prime_batch_scalar(const uint4 *x, int n, bool *prime)
+{
+  for( int i = 0; i < n; i++ ) {
+    prime[i] = is_prime(x[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void is_prime_batch_avx2(const uint4 *x, int n, bool *prime)
+{
+  for( int g = 0; g < n; g += 8 ) {
+    int m = std::min(8, n - g);
+    uint4 lanes[8] = { 0 };
+    uint4 largest = 0;
+    for( int i = 0; i < m; i++ ) {
+      lanes[i] = x[g + i];
+      largest = std::max(largest, lanes[i]);
+    }
+    uint4 root = isqrt(largest);
+    __m256i v = _mm256_loadu_si256((const __m256i *)lanes);
+
+    // Lanes past n, x < 2, and even x other than 2 start out composite
+    uint4 start[8];
+    for( int i = 0; i < 8; i++ ) {
+      start[i] = i >= m || lanes[i] < 2 || (lanes[i] != 2 && !( lanes[i] & 1 )) ? ~0U : 0;
+    }
+    __m256i composite = _mm256_loadu_si256((const __m256i *)start);
+
+    for( uint4 k = 0; k < numBasePrimes && basePrimes[k] <= root; k++ ) {
+      if( _mm256_movemask_epi8(composite) == -1 ) {
+        break;  // all 8 have a divisor
+      }
+      __m256i q = _mm256_mullo_epi32(v, _mm256_set1_epi32((int)basePrimeInverses[k]));
+      __m256i lim = _mm256_set1_epi32((int)basePrimeLimits[k]);
+      // unsigned q <= lim, as min(q, lim) == q
+      __m256i divisible = _mm256_cmpeq_epi32(_mm256_min_epu32(q, lim), q);
+      // p itself is prime, though p divides it
+      __m256i self = _mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)basePrimes[k]));
+      composite = _mm256_or_si256(composite, _mm256_andnot_si256(self, divisible));
+    }
+
+    uint4 result[8];
+    _mm256_storeu_si256((__m256i *)result, composite);
+    for( int i = 0; i < m; i++ ) {
+      prime[g + i] = result[i] == 0;
+    }
+  }
+}
+
+static void (*pick_batch_kernel())(const uint4 *, int, bool *)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? is_prime_batch_avx2 : is_prime_batch_scalar;
+}
+
+static void (*is_prime_batch_kernel)(const uint4 *, int, bool *) = pick_batch_kernel();
+
+void is_prime_batch(const uint4 *x, int n, bool *prime)
+{
+  is_prime_batch_kernel(x, n, prime);
+}
+
+void is_prime_batch(const uint8 *x, int n, bool *prime)
+{
+  for( int i = 0; i < n; i++ ) {
+    prime[i] = is_prime(x[i]);
+  }
+}
+
+
+// Set bit j of bits, for every odd number first + 2j in [first, hi]
+// that is a multiple of a base prime p, starting at p*p (smaller
+// multiples of p also have a smaller prime factor, so they are
+// crossed off by that one).  first must be odd, there must be n odd
+// numbers in [first, hi], and the n bits must be 0 to start with.
+template <typename T>
+void cross_off(T first, T hi, uint4 n, uint8 *bits)
+{
+  for( uint4 k = 0; k < numBasePrimes; k++ ) {
+    uint8 p = basePrimes[k];
+    uint8 m = p * p;
+    if( m > hi ) {
+      break;
+    }
+    if( m < first ) {
+      // smallest odd multiple of p that is >= first.  Written so
+      // that it cannot overflow when hi is close to the largest T.
+      uint8 r = first % p;
+      uint8 up = r ? p - r : 0;
+      if( up > (uint8)(hi - first) ) {
+        continue;
+      }
+      m = first + up;
+      if( !( m & 1 ) ) {
+        if( p > hi - m ) {
+          continue;
+        }
+        m += p;
+      }
+    }
+    for( uint8 j = (m - first) / 2; j < n; j += p ) {
+      bits[j / 64] |= 1ULL << (j % 64);
+    }
+  }
+}
+
+
+// Sieve the slice [lo, hi] and add its primes to *s.  bits must
+// have room for sieveBits bits, and hi - lo must be less than
+// 2*sieveBits.
+//
+// Bit j of the array stands for the odd number first + 2j; see
+// cross_off().  The bits left at 0 are primes.
+template <typename T>
+void sieve_slice(T lo, T hi, uint8 *bits, Summary<T> *s)
+{
+  if( lo <= 2 && 2 <= hi ) {
+    // 2 is the only even prime, and has no bit
+    s->add(2);
+  }
+
+  T first = lo | 1;   // first odd number in the slice
+  if( first > hi ) {
+    return;
+  }
+  uint4 n = (uint4)((hi - first) / 2 + 1);  // number of odd numbers in [first, hi]
+  uint4 words = (n + 63) / 64;
+  memset(bits, 0, words * sizeof(uint8));
+
+  cross_off(first, hi, n, bits);
+  if( first == 1 ) {
+    bits[0] |= 1;  // 1 is not a prime
+  }
+
+  // Mark the unused bits past the end of the slice, so that
+  // every 0 bit left in the array is a prime.
+  if( n % 64 ) {
+    bits[words - 1] |= ~0ULL << (n % 64);
+  }
+
+  // Visit the 0 bits in order, lowest first: ~bits[w] & -~bits[w]
+  // is the lowest 1 bit of ~bits[w], and ctz finds its position.
+  for( uint4 w = 0; w < words; w++ ) {
+    uint8 primes = ~bits[w];
+    while( primes ) {
+      uint4 j = w * 64 + (uint4)__builtin_ctzll(primes);
+      s->add(first + 2 * (T)j);
+      primes &= primes - 1;
+    }
+  }
+}
+
+
+// The wheel of the primes 2, 3 and 5.  Every prime past 5 is
+// coprime to 30, so it is one of the 8 residues mod 30 below: only
+// 8/30 = 27% of the integers are worth testing.  wheelGaps[k] is the
+// distance from wheelResidues[k] to the next residue, and
+// wheelIndex[r] is the index of the first residue >= r.
+const uint4 wheelSize = 30;
+const uint4 wheelResidues[8] = { 1, 7, 11, 13, 17, 19, 23, 29 };
+const uint4 wheelGaps[8] = { 6, 4, 2, 4, 2, 4, 6, 2 };
+const unsigned char wheelIndex[wheelSize] = {
+  0, 0, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7
+};
+const uint4 wheelPrimes[3] = { 2, 3, 5 };
+
+
+// Number of candidates test_slice() gives is_prime_batch() at once:
+// all of those in one slice of 8 wheel turns.
+const int trialBatch = 64;
+
+// Test the integers in the slice [lo, hi], with trial division or
+// Miller-Rabin, and add the primes found to *s.  The wheel skips
+// every multiple of 2, 3 and 5; those three primes are added from
+// wheelPrimes[] instead.  In TRIAL mode the candidates are tested
+// trialBatch at a time by is_prime_batch().
+template <typename T>
+void test_slice(Mode mode, T lo, T hi, Summary<T> *s)
+{
+  for( uint4 p : wheelPrimes ) {
+    if( lo <= p && p <= hi ) {
+      s->add(p);
+    }
+  }
+
+  uint4 r = (uint4)(lo % wheelSize);
+  uint4 k = wheelIndex[r];
+  if( hi - lo < wheelResidues[k] - r ) {
+    return;
+  }
+  T batch[trialBatch];
+  bool prime[trialBatch];
+  int n = 0;
+  // As in prime_thread(), the distance to hi is compared instead
+  // of i + step, which could wrap around.
+  for( T i = lo + (wheelResidues[k] - r); ; ) {
+    if( mode == TRIAL ) {
+      batch[n++] = i;
+    } else if( is_prime_mr( i ) ) {
+      s->add(i);
+    }
+    T step = wheelGaps[k];
+    k = (k + 1) % 8;
+    bool last = hi - i < step;
+    if( n == trialBatch || (last && n > 0) ) {
+      is_prime_batch(batch, n, prime);
+      for( int j = 0; j < n; j++ ) {
+        if( prime[j] ) {
+          s->add(batch[j]);
+        }
+      }
+      n = 0;
+    }
+    if( last ) {
+      break;
+    }
+    i += step;
+  }
+}
+
+
+// Take the next slices to check from the job's own queue, or if it
+// is empty, steal from another job's queue.  Stores the slice
+// numbers in [*first, *first + *count) and returns true, or returns
+// false when there is no work left anywhere.
+//
+// The owner takes 1/8 of what is left in its queue (at least one
+// slice).  The chunks start out large, so a thread rarely touches
+// the mutex, and get smaller as the queue drains, so that at the end
+// there are small pieces left for the other threads to steal.
+template <typename T>
+bool take_work(Job<T> *job, T *first, T *count)
+{
+  WorkQueue<T> *own = &job->queues[job->id];
+
+  for( int k = 0; k <= job->tn; k++ ) {
+    if( k > 0 ) {
+      // Our queue is empty: steal the upper half of the next
+      // non-empty queue, and put it in our own.
+      WorkQueue<T> *victim = &job->queues[(job->id + k) % job->tn];
+      if( victim == own ) {
+        continue;
+      }
+      profile_lock( job->profile, &victim->mutex );
+      T left = victim->tail - victim->head;
+      T stolenHead = victim->tail - (left + 1) / 2;
+      T stolenTail = victim->tail;
+      victim->tail = stolenHead;
+      pthread_mutex_unlock( &victim->mutex );
+      if( stolenHead == stolenTail ) {
+        continue;
+      }
+      profile_lock( job->profile, &own->mutex );
+      own->head = stolenHead;
+      own->tail = stolenTail;
+      pthread_mutex_unlock( &own->mutex );
+    }
+
+    profile_lock( job->profile, &own->mutex );
+    T left = own->tail - own->head;
+    if( left > 0 ) {
+      *first = own->head;
+      *count = left / 8 + 1;
+      if( *count > left ) {
+        *count = left;
+      }
+      own->head += *count;
+      pthread_mutex_unlock( &own->mutex );
+      return true;
+    }
+    pthread_mutex_unlock( &own->mutex );
+  }
+  return false;
+}
+
+
 // All threads will run this function when started.
 // The thread retrieves the job that was passed in as an
 // argument, checks for prime numbers, and then saves
 // its answer back into the job struct.
+template <typename T>
 void *prime_thread(void *data)
 {
-  Job *job = (Job*)data;
-  job->res = 0;
-  uint4 slice;
-  uint4 sliceEnd;
-  uint4 i;
-
-  for( slice = job->start; slice < job->end; slice += job->sliceStep ) {
-    sliceEnd = slice + job->sliceLength;
-    if( sliceEnd > job->end ) {
-      sliceEnd = job->end;
-    }
-    for( i = slice; i < sliceEnd; i++ ) {
-      if( is_prime( i ) ) {
-	job->res += 1;
-	if( i > largestPrime) {
-	  pthread_mutex_lock( &largestPrimeMutex );
-	  // It is not a mistake to have this check twice.
-	  // If we only did the first check, it's possible that
-	  // another thread could change largestPrime after we
-	  // do the first check, but before we get the mutex.
-	  // We would then take the mutex and overwrite the
-	  // other thread's largestPrime, possibly incorrectly.
-	  // Another solution would just be to have one check
-	  // and the mutex outside of it, but then we would
-	  // unnecessarily wait for the mutex every time, even
-	  // if i is not the largest prime.
-	  if( i > largestPrime) {
-	    largestPrime = i;
-	  }
-	  pthread_mutex_unlock( &largestPrimeMutex );
-	}
+  Job<T> *job = (Job<T>*)data;
+  T slice;
+  T sliceLast;
+  T first;
+  T count;
+  uint8 *bits = 0;
+
+  if( job->mode == SIEVE ) {
+    bits = new uint8[sieveBits / 64];
+  }
+
+  profile_begin( job->profile );
+  while( take_work( job, &first, &count ) ) {
+    Chunk<T> chunk;  // local, not in job->chunks; see struct Job
+    chunk.firstSlice = first;
+
+    for( T k = first; k < first + count; k++ ) {
+      // Slice k never starts past b, but it may end past it.  The
+      // comparison is written as a distance from b because
+      // slice + sliceLength could wrap around when b is close to
+      // the largest T.
+      slice = job->a + k * job->sliceLength;
+      if( job->last - slice < job->sliceLength ) {
+        sliceLast = job->last;
+      } else {
+        sliceLast = slice + (job->sliceLength - 1);
+      }
+      if( job->mode == SIEVE ) {
+        sieve_slice( slice, sliceLast, bits, &chunk.summary );
+      }
+      else {
+        test_slice( job->mode, slice, sliceLast, &chunk.summary );
       }
     }
+    job->chunks.push_back( chunk );
+    profile_units( job->profile, count );
   }
+  profile_end( job->profile );
 
+  delete [] bits;
   return 0;
 }
 
-// compute number of primes in interval [a, b] using tn pthreads
-uint4 num_primes(uint4 a, uint4 b, int tn)
+// An on-disk cache of which odd numbers in [0, limit] are prime, so
+// that a question about any [a, b] inside it can be answered without
+// checking a single integer (see PrimeCache::summary()).
+//
+// The file holds a CacheHeader, then numBlocks + 1 CacheBlocks, then
+// the bitmap: bit j is 1 iff the odd number 2j+1 is prime.  With only
+// odd numbers, [0, 2^32) takes 2^31 bits, i.e. 256 MB.  The bitmap is
+// cut into blocks of cacheBlockBits bits, and CacheBlock k tells how
+// many primes come before block k.  So counting the primes up to x
+// takes one lookup, plus popcounts over at most one block.
+//
+// The file is written once by build_cache(), and mmapped read-only
+// by open_cache().  Nothing is read from it up front: a query only
+// pays for the page faults of the few pages it touches.
+const uint4 cacheBlockBits = 1 << 12;  // 64 words of bits, 512 bytes
+
+struct CacheHeader
+{
+  char  magic[8];    // cacheMagic
+  uint8 limit;       // the cache covers [0, limit]
+  uint8 numBlocks;   // the bitmap has numBlocks * cacheBlockBits bits
+  uint8 bitsOffset;  // where the bitmap starts in the file (page aligned)
+};
+
+const char cacheMagic[8] = "PRIMES1";
+
+// What comes before block k of the bitmap (and one thing in it).
+// Gaps are small (under 1500 for any x < 2^64), so maxGap fits in a uint4.
+struct CacheBlock
+{
+  uint8 primes;  // number of odd primes before the block
+  uint8 twins;   // number of twin pairs whose larger prime is before the block
+  uint4 maxGap;  // largest gap between consecutive odd primes, the larger in the block
+};
+
+struct PrimeCache
+{
+  uint8 limit;          // 0 if no cache is open
+  uint8 numBlocks;
+  const CacheBlock *blocks;
+  const uint8 *bits;
+  void *map;            // the whole file, as mmapped
+  size_t mapSize;
+
+  bool covers(uint8 b) const
+  {
+    return bits != 0 && b <= limit;
+  }
+
+  bool bit(uint8 j) const
+  {
+    return (bits[j / 64] >> (j % 64)) & 1;
+  }
+
+  // number of 1 bits in [0, j)
+  uint8 rank(uint8 j) const
+  {
+    uint8 r = blocks[j / cacheBlockBits].primes;
+    for( uint8 w = j / cacheBlockBits * (cacheBlockBits / 64); w < j / 64; w++ ) {
+      r += (uint8)__builtin_popcountll(bits[w]);
+    }
+    if( j % 64 ) {
+      r += (uint8)__builtin_popcountll(bits[j / 64] & ((1ULL << (j % 64)) - 1));
+    }
+    return r;
+  }
+
+  // number of twin pairs j, j+1 (odd primes p, p+2) with j+1 < end
+  uint8 twin_rank(uint8 end) const
+  {
+    uint8 k = end / cacheBlockBits;
+    uint8 t = blocks[k].twins;
+    for( uint8 w = k * (cacheBlockBits / 64); w * 64 < end; w++ ) {
+      // bit i of pairs is set iff bits i-1 and i are both set
+      uint8 pairs = bits[w] & ((bits[w] << 1) | (w ? bits[w - 1] >> 63 : 0));
+      if( end - w * 64 < 64 ) {
+        pairs &= (1ULL << (end - w * 64)) - 1;
+      }
+      t += (uint8)__builtin_popcountll(pairs);
+    }
+    return t;
+  }
+
+  // smallest j' >= j whose bit is set, or none() if there is none
+  uint8 next_set(uint8 j) const
+  {
+    uint8 end = numBlocks * cacheBlockBits;
+    if( j >= end ) {
+      return none();
+    }
+    uint8 w = j / 64;
+    uint8 word = bits[w] & (~0ULL << (j % 64));
+    while( !word ) {
+      if( ++w == end / 64 ) {
+        return none();
+      }
+      word = bits[w];
+    }
+    return w * 64 + (uint8)__builtin_ctzll(word);
+  }
+
+  // largest j' < j whose bit is set, or none() if there is none
+  uint8 prev_set(uint8 j) const
+  {
+    if( j == 0 ) {
+      return none();
+    }
+    uint8 w = (j - 1) / 64;
+    uint8 word = bits[w] & (~0ULL >> (63 - (j - 1) % 64));
+    while( !word ) {
+      if( w-- == 0 ) {
+        return none();
+      }
+      word = bits[w];
+    }
+    return w * 64 + 63 - (uint8)__builtin_clzll(word);
+  }
+
+  static uint8 none()
+  {
+    return ~0ULL;
+  }
+
+  // largest gap between the consecutive odd primes 2*from+1 < ... <=
+  // 2*to+1, where bits from and to are set.  Only the bits of the
+  // first and last block are looked at.
+  uint8 max_gap(uint8 from, uint8 to) const
+  {
+    uint8 gap = 0;
+    uint8 prev = from;
+    uint8 firstEnd = (from / cacheBlockBits + 1) * cacheBlockBits;
+    if( to >= firstEnd ) {
+      // the first block, then the middle ones from the index,
+      // then the last block from the prime just before it
+      gap = scan_gaps(from, firstEnd);
+      for( uint8 k = firstEnd / cacheBlockBits; k < to / cacheBlockBits; k++ ) {
+        gap = std::max(gap, (uint8)blocks[k].maxGap);
+      }
+      prev = prev_set(to / cacheBlockBits * cacheBlockBits);
+    }
+    return std::max(gap, scan_gaps(prev, to + 1));
+  }
+
+  // largest gap between consecutive set bits in [prev, end), as a
+  // difference of odd numbers; bit prev must be set
+  uint8 scan_gaps(uint8 prev, uint8 end) const
+  {
+    uint8 gap = 0;
+    for( uint8 j = next_set(prev + 1); j < end; j = next_set(j + 1) ) {
+      gap = std::max(gap, 2 * (j - prev));
+      prev = j;
+    }
+    return gap;
+  }
+
+  // What num_primes() would find in [a, b], which must be covered.
+  template <typename T>
+  Summary<T> summary(T a, T b) const
+  {
+    Summary<T> s;
+    bool two = a <= 2 && 2 <= b;  // 2 has no bit
+    uint8 ja = (uint8)a / 2;        // bits [ja, jb) are the odd numbers in [a, b]
+    uint8 jb = ((uint8)b + 1) / 2;
+    if( ja >= jb ) {
+      if( two ) {
+        s.add(2);
+      }
+      return s;
+    }
+
+    s.count = (T)(rank(jb) - rank(ja) + two);
+    s.twins = (T)(twin_rank(jb) - twin_rank(ja + 1));
+
+    uint8 first = next_set(ja);
+    uint8 last = prev_set(jb);
+    if( first >= jb ) {
+      first = last = none();
+    }
+    s.first = two ? 2 : (first != none() ? (T)(2 * first + 1) : 0);
+    s.last = last != none() ? (T)(2 * last + 1) : (two ? 2 : 0);
+    if( two && first != none() ) {
+      s.maxGap = 1;  // from 2 to 3
+    }
+    if( first != none() && first < last ) {
+      s.maxGap = std::max(s.maxGap, (T)max_gap(first, last));
+    }
+    return s;
+  }
+};
+
+PrimeCache primeCache;  // see open_cache()
+
+
+// What one build_cache() thread has to do: first sieve slices of the
+// bitmap, then, when every thread is done with that, fill in the
+// blocks of the index.  Both are taken a slice (of sieveBits bits,
+// i.e. sieveBits / cacheBlockBits blocks) at a time from next.
+struct CacheJob
+{
+  PrimeCache *cache;
+  uint8 *bits;               // the bitmap in the file, writable
+  CacheBlock *blocks;        // the index in the file, writable
+  uint8 numSlices;
+  std::atomic<uint8> *next[2];  // next slice to take, in each phase
+  pthread_barrier_t *barrier;
+};
+
+void *cache_thread(void *data)
+{
+  CacheJob *job = (CacheJob *)data;
+  const PrimeCache *cache = job->cache;
+  const uint4 sliceWords = sieveBits / 64;
+  const uint4 sliceBlocks = sieveBits / cacheBlockBits;
+
+  // Sieve the slice [lo, hi] straight into the file, then flip the
+  // bits: the sieve marks composites, but the bitmap marks primes so
+  // that they can be counted with popcount.
+  for( uint8 k; (k = (*job->next[0])++) < job->numSlices; ) {
+    uint8 *bits = job->bits + k * sliceWords;
+    uint8 lo = k * 2 * sieveBits;
+    uint8 hi = std::min(lo + (2 * sieveBits - 1), cache->limit);
+    uint4 n = (uint4)((hi - (lo | 1)) / 2 + 1);
+    cross_off<uint8>(lo | 1, hi, n, bits);
+    for( uint4 w = 0; w < sliceWords; w++ ) {
+      uint8 word = w * 64 < n ? ~bits[w] : 0;
+      if( w * 64 < n && n - w * 64 < 64 ) {
+        word &= (1ULL << (n - w * 64)) - 1;
+      }
+      bits[w] = word;
+    }
+    if( k == 0 ) {
+      bits[0] &= ~1ULL;  // 1 is not a prime
+    }
+  }
+
+  pthread_barrier_wait( job->barrier );
+
+  // For now blocks[k+1] only gets what is in block k; build_cache()
+  // adds them up.  The gap into a block starts from the last prime
+  // of an earlier block, which may have been sieved by another
+  // thread: that is why we waited for all of them.
+  for( uint8 k; (k = (*job->next[1])++) < job->numSlices; ) {
+    for( uint8 blk = k * sliceBlocks; blk < (k + 1) * sliceBlocks; blk++ ) {
+      uint8 begin = blk * cacheBlockBits;
+      uint8 primes = 0;
+      uint8 twins = 0;
+      for( uint8 w = begin / 64; w < (begin + cacheBlockBits) / 64; w++ ) {
+        uint8 word = job->bits[w];
+        primes += (uint8)__builtin_popcountll(word);
+        twins += (uint8)__builtin_popcountll(word & ((word << 1) | (w ? job->bits[w - 1] >> 63 : 0)));
+      }
+      uint8 gap = 0;
+      uint8 prev = cache->prev_set(begin);
+      for( uint8 j = cache->next_set(begin); j < begin + cacheBlockBits; j = cache->next_set(j + 1) ) {
+        if( prev != PrimeCache::none() ) {
+          gap = std::max(gap, 2 * (j - prev));
+        }
+        prev = j;
+      }
+      job->blocks[blk + 1].primes = primes;
+      job->blocks[blk + 1].twins = twins;
+      job->blocks[blk].maxGap = (uint4)gap;
+    }
+  }
+  return 0;
+}
+
+
+// Write the cache of [0, limit] to file, using tn threads.  It is
+// written to file.tmp first and renamed when complete, so that a
+// reader never maps half a cache.  Exits if the file cannot be written.
+void build_cache(const char *file, uint8 limit, int tn)
+{
+  assert( isqrt(limit) <= maxSieveRoot );
+  find_base_primes( isqrt(limit) );
+
+  // Every slice is whole in the file, so the threads never share a
+  // word; the bits past limit are left at 0.
+  uint8 numSlices = ((limit + 1) / 2 + sieveBits - 1) / sieveBits;
+  uint8 numBlocks = numSlices * (sieveBits / cacheBlockBits);
+  uint8 pageSize = (uint8)sysconf(_SC_PAGESIZE);
+  uint8 bitsOffset = sizeof(CacheHeader) + (numBlocks + 1) * sizeof(CacheBlock);
+  bitsOffset = (bitsOffset + pageSize - 1) / pageSize * pageSize;
+  size_t size = (size_t)(bitsOffset + numBlocks * cacheBlockBits / 8);
+
+  std::string tmp = std::string(file) + ".tmp";
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if( fd < 0 || ftruncate(fd, (off_t)size) != 0 ) {
+    perror(tmp.c_str());
+    exit(1);
+  }
+  char *map = (char *)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if( map == MAP_FAILED ) {
+    perror(tmp.c_str());
+    exit(1);
+  }
+  close(fd);
+
+  CacheHeader *header = (CacheHeader *)map;
+  CacheBlock *blocks = (CacheBlock *)(map + sizeof(CacheHeader));
+  uint8 *bits = (uint8 *)(map + bitsOffset);
+
+  // The threads use primeCache's lookups on the bitmap they fill in
+  PrimeCache cache;
+  cache.limit = limit;
+  cache.numBlocks = numBlocks;
+  cache.blocks = blocks;
+  cache.bits = bits;
+  cache.map = map;
+  cache.mapSize = size;
+
+  std::atomic<uint8> next[2];
+  next[0] = next[1] = 0;
+  pthread_barrier_t barrier;
+  pthread_barrier_init( &barrier, 0, (unsigned)tn );
+  pthread_t threads[tn];
+  CacheJob job = { &cache, bits, blocks, numSlices, { &next[0], &next[1] }, &barrier };
+  for( int i = 0; i < tn; i++ ) {
+    pthread_create( &threads[i], 0, cache_thread, &job );
+  }
+  for( int i = 0; i < tn; i++ ) {
+    pthread_join( threads[i], NULL );
+  }
+  pthread_barrier_destroy( &barrier );
+
+  blocks[0].primes = blocks[0].twins = 0;
+  blocks[numBlocks].maxGap = 0;
+  for( uint8 k = 1; k <= numBlocks; k++ ) {
+    blocks[k].primes += blocks[k - 1].primes;
+    blocks[k].twins += blocks[k - 1].twins;
+  }
+
+  // The header goes last: a file without the magic is not a cache
+  header->limit = limit;
+  header->numBlocks = numBlocks;
+  header->bitsOffset = bitsOffset;
+  memcpy(header->magic, cacheMagic, sizeof(cacheMagic));
+  if( msync(map, size, MS_SYNC) != 0 || rename(tmp.c_str(), file) != 0 ) {
+    perror(file);
+    exit(1);
+  }
+  munmap(map, size);
+}
+
+
+// Map the cache in file into primeCache, read-only.  Returns false
+// if there is no such file, or it is not a complete cache.
+bool open_cache(const char *file)
+{
+  int fd = open(file, O_RDONLY);
+  if( fd < 0 ) {
+    return false;
+  }
+  struct stat st;
+  if( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader) ) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  void *map = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if( map == MAP_FAILED ) {
+    return false;
+  }
+
+  const CacheHeader *header = (const CacheHeader *)map;
+  if( memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) != 0 ||
+      header->bitsOffset + header->numBlocks * cacheBlockBits / 8 != size ||
+      (header->limit + 1) / 2 > header->numBlocks * cacheBlockBits ) {
+    munmap(map, size);
+    return false;
+  }
+  primeCache.limit = header->limit;
+  primeCache.numBlocks = header->numBlocks;
+  primeCache.blocks = (const CacheBlock *)((const char *)map + sizeof(CacheHeader));
+  primeCache.bits = (const uint8 *)((const char *)map + header->bitsOffset);
+  primeCache.map = map;
+  primeCache.mapSize = size;
+  return true;
+}
+
+
+// prime_pi() keeps two arrays of sqrt(x) uint8s, so past 2^48 they
+// would take more than 256 MB, and it would run for minutes.
+const uint8 maxPi = 1ULL << 48;
+
+// return pi(x), the number of primes <= x, with Lucy_Hedgehog's
+// method, in about x^(3/4) operations (2^24 for x = 2^32) instead of
+// the x the sieve needs.
+//
+// Let S(v, p) be the number of integers in [2, v] that are prime or
+// have no prime factor < p.  S(v, 2) = v - 1, and once p > sqrt(v),
+// S(v, p) = pi(v).  Going from p to the next prime crosses off the
+// integers in [2, v] whose smallest prime factor is p, i.e. p times
+// the integers in [p, v/p] with no prime factor < p:
+//
+//   S(v, p+) = S(v, p) - (S(v/p, p) - pi(p-1))
+//
+// The only v ever needed are the values x/i, and there are at most
+// 2*sqrt(x) of them: small[v] holds S(v) for v <= r, and large[i]
+// holds S(x/i) for i <= r.  For each prime p, the v are updated from
+// the largest down, so that S(v/p) is still the one for p.
+uint8 prime_pi(uint8 x)
+{
+  assert( x <= maxPi );
+  if( x < 2 ) {
+    return 0;
+  }
+  uint4 r = isqrt(x);
+  std::vector<uint8> small(r + 1);
+  std::vector<uint8> large(r + 1);
+  for( uint4 v = 1; v <= r; v++ ) {
+    small[v] = v - 1;
+    large[v] = x / v - 1;
+  }
+
+  for( uint8 p = 2; p <= r; p++ ) {
+    if( small[p] == small[p - 1] ) {
+      continue;  // p is not a prime
+    }
+    uint8 sp = small[p - 1];  // pi(p-1)
+    uint8 p2 = p * p;
+    uint8 end = std::min((uint8)r, x / p2);
+    for( uint8 i = 1; i <= end; i++ ) {
+      uint8 d = i * p;
+      large[i] -= (d <= r ? large[d] : small[x / d]) - sp;
+    }
+    for( uint8 v = r; v >= p2; v-- ) {
+      small[v] -= small[v / p] - sp;
+    }
+  }
+  return large[1];
+}
+
+
+// Pick the fastest way to check [a, b], based on how wide the range
+// is and how high it sits:
+//  - The sieve has a fixed cost of about sqrt(b) to find the base
+//    primes and to start crossing off in every slice, but after that
+//    each integer costs only a few operations.  It wins whenever the
+//    range is at least as wide as sqrt(b).
+//  - For a narrow window (e.g. near 2^32), testing each integer
+//    on its own is cheaper.  Trial division costs up to sqrt(x)/2
+//    divisions and Miller-Rabin about a hundred multiplications, so
+//    trial division is only used while sqrt(b) is small.
+//  - Past 2^52 the base primes get too many (see maxSieveRoot).
+Mode choose_mode(uint8 a, uint8 b)
+{
+  uint4 root = isqrt(b);
+  if( b - a >= root && root <= maxSieveRoot ) {
+    return SIEVE;
+  }
+  return root < 256 ? TRIAL : MILLER_RABIN;
+}
+
+template <typename T>
+Summary<T> pi_primes(T a, T b, int tn);
+
+// compute number of primes in interval [a, b] using tn pthreads,
+// as well as the other statistics in Summary.
+//
+// T is uint4 or uint8; main() uses uint4 whenever b fits in it.
+template <typename T>
+Summary<T> num_primes(T a, T b, int tn, Mode mode)
 {
   assert(a <= b);
   assert(tn > 0);
+  if( primeCache.covers(b) ) {
+    return primeCache.summary(a, b);
+  }
+  if( mode == PI ) {
+    return pi_primes(a, b, tn);
+  }
+  if( mode == AUTO ) {
+    mode = choose_mode(a, b);
+  }
   pthread_t threads[tn];
-  Job jobs[tn];
+  Job<T> jobs[tn];
+  WorkQueue<T> queues[tn];
+  ThreadProfile profiles[tn];
 
-  const int sliceLength = 250;
-  const int sliceStep = sliceLength * tn;
+  // A sieve slice is as long as its bit array allows: the work per
+  // slice is dominated by the base primes, so slices of 240 would
+  // spend all their time finding where to start crossing off.
+  // Otherwise a slice is 8 turns of the wheel (see test_slice()), so
+  // that every slice has exactly 64 integers to test.
+  const T sliceLength = mode == SIEVE ? 2 * sieveBits : 8 * wheelSize;
 
-  // create work items and launch threads.
+  // Number of slices.  (b - a) / sliceLength cannot overflow, unlike
+  // b - a + 1, and adding one to it cannot either since sliceLength > 1.
+  const T numSlices = (b - a) / sliceLength + 1;
+
+  if( mode == SIEVE ) {
+    assert( isqrt(b) <= maxSieveRoot );
+    find_base_primes( isqrt(b) );
+  }
+  if( mode == TRIAL && sizeof(T) == 4 ) {
+    find_base_primes( isqrt(b) );
+    find_base_inverses();
+  }
+
+  // split the slices between the work queues.
   for (int i=0; i < tn; ++i) {
 
     // There are several ways we could divide the range [a,b]
@@ -149,20 +1291,47 @@ uint4 num_primes(uint4 a, uint4 b, int tn)
     // even numbers!  Same with tn divisible by 3 and every third thread,
     // etc.
     //
+    // Even fancier: divide [a,b] into slices of equal width, and
+    // hand them out round-robin: thread i gets slices i, i+tn,
+    // i+2tn, ...  Every thread gets a similar mix of slices, but
+    // the split is still decided before the threads start.  If one
+    // thread runs slower than the others (because another program,
+    // or its SMT sibling, is using the same core), everybody waits
+    // for it at the join.
+    //
     // This approach:
     // Divide [a,b] into a large number of slices of equal width,
-    // (sliceLength = 250 in our code above).  Each thread will
-    // handle a number of slices spread out across the range [a,b].
-    // Some slices are easier than others (ie, earlier is easier
-    // than later).  But every slice some even numbers, some
-    // numbers divisible by 3, etc.  So no thread should have a much
-    // easier job than another.
-
-    jobs[i].start = sliceLength * i;
+    // (sliceLength = 240 in our code above), and give each thread
+    // an equal contiguous block of them, in its own WorkQueue.
+    // Later slices are harder than earlier ones, and threads run
+    // at different speeds, but a thread that runs out of work steals
+    // half of the slices another thread has not started yet (see
+    // take_work()).  So no thread sits idle while there is work left.
+
+    T n = numSlices / (T)tn;
+    T extra = numSlices % (T)tn;  // the first `extra` queues get one more
+    T head = n * (T)i + ((T)i < extra ? (T)i : extra);
+    pthread_mutex_init( &queues[i].mutex, 0 );
+    queues[i].head = head;
+    queues[i].tail = head + n + ((T)i < extra ? 1 : 0);
+  }
+
+  // create work items and launch threads.
+  std::vector<int> cpus = placement_order(placement);
+  for (int i=0; i < tn; ++i) {
+    jobs[i].id = i;
+    jobs[i].tn = tn;
+    jobs[i].queues = queues;
+    jobs[i].a = a;
     jobs[i].sliceLength = sliceLength;
-    jobs[i].sliceStep = sliceStep;
-    jobs[i].end = b+1; // [start,end) == [start,b]
-    pthread_create( &threads[ i ], 0, prime_thread, &jobs[i] );
+    jobs[i].last = b;
+    jobs[i].mode = mode;
+    profiles[i] = ThreadProfile();
+    jobs[i].profile = &profiles[i];
+    pthread_create( &threads[ i ], 0, prime_thread<T>, &jobs[i] );
+    if( placement != UNPINNED ) {
+      pin_thread( threads[ i ], cpus[ (size_t)i % cpus.size() ] );
+    }
   }
 
 
@@ -170,22 +1339,140 @@ uint4 num_primes(uint4 a, uint4 b, int tn)
   for( int i = 0; i < tn; ++i ) {
     pthread_join( threads[ i ], NULL );
   }  
+  profile_report( "prime_thread", profiles, tn );
 
 
-  // add up partial sums computed by the jobs
-  uint4 primes = 0;
+  // Put the chunks computed by all the jobs back in order, and
+  // merge them.  There are only a few per thread (see take_work()).
+  std::vector< Chunk<T> > chunks;
   for (int i=0; i < tn; ++i) {
-    primes += jobs[ i ].res;
+    chunks.insert( chunks.end(), jobs[ i ].chunks.begin(), jobs[ i ].chunks.end() );
+    pthread_mutex_destroy( &queues[i].mutex );
+  }
+  std::sort( chunks.begin(), chunks.end() );
+
+  Summary<T> primes;
+  for (size_t i=0; i < chunks.size(); ++i) {
+    primes.append( chunks[ i ].summary );
   }
   return primes;
 }
 
 
+// The PI mode of num_primes(): count the primes in [a, b] with
+// prime_pi(), and find the smallest and largest of them by checking
+// windows at either end of the range with the other modes, doubling
+// the window until it holds a prime.  Primes are dense enough (the
+// gaps are under 1500 below 2^64) that the first window of 4096
+// integers almost always does.  twins and maxGap are left at 0.
+template <typename T>
+Summary<T> pi_primes(T a, T b, int tn)
+{
+  Summary<T> s;
+  s.count = (T)(prime_pi(b) - prime_pi(a - 1));
+  if( s.count == 0 ) {
+    return s;
+  }
+  for( T w = 4096; ; w *= 2 ) {
+    T hi = b - a < w ? b : a + (w - 1);
+    Summary<T> window = num_primes<T>(a, hi, tn, AUTO);
+    if( window.count > 0 ) {
+      s.first = window.first;
+      break;
+    }
+  }
+  for( T w = 4096; ; w *= 2 ) {
+    T lo = b - a < w ? a : b - (w - 1);
+    Summary<T> window = num_primes<T>(lo, b, tn, AUTO);
+    if( window.count > 0 ) {
+      s.last = window.last;
+      break;
+    }
+  }
+  return s;
+}
+
+
+// num_primes() with T = uint4 whenever b fits in it
+Summary<uint8> any_primes(uint8 a, uint8 b, int tn, Mode mode)
+{
+  if( b > 0xFFFFFFFFULL ) {
+    return num_primes<uint8>(a, b, tn, mode);
+  }
+  Summary<uint4> r = num_primes<uint4>((uint4)a, (uint4)b, tn, mode);
+  Summary<uint8> result;
+  result.count = r.count;
+  result.first = r.first;
+  result.last = r.last;
+  result.twins = r.twins;
+  result.maxGap = r.maxGap;
+  return result;
+}
+
+
+void usage(const char *prog)
+{
+  printf("usage: %s [-m auto|trial|sieve|mr|pi] [-c file [-C limit]] [-x] [-a placement] a b [tn]\n"
+         "Computes the number of primes in [a,b] using tn threads (default:\n"
+         "one per physical core, %d here)\n"
+         "  -m  how to test each integer (default: auto); pi only counts\n"
+         "      the primes, as pi(b) - pi(a-1), for b up to 2^48\n"
+         "  -c  answer from the prime cache in file if it covers b; the\n"
+         "      cache is built first (with tn threads) if file is missing\n"
+         "  -C  (re)build the cache to cover [0,limit] (default: 2^32-1)\n"
+         "  -x  check the result against the sieve, trial division or\n"
+         "      Miller-Rabin (whichever auto picks), without the cache\n"
+         "  -a  pin the threads: compact (fill each core's SMT threads\n"
+         "      first), scatter (one per core first), or none (default)\n",
+         prog, default_threads());
+  exit(1);
+}
+
+
 int main(int argc, char *argv[])
 {
-  if (argc != 4) {
-    printf("usage: %s a b tn\nComputes the number of primes in [a,b] using tn threads\n", argv[0]);
-    exit(1);
+  const char *prog = argv[0];
+  Mode mode = AUTO;
+  const char *cacheFile = 0;
+  uint8 cacheLimit = 0;  // 0: only build the cache if it is missing
+  bool check = false;
+  int opt;
+  while( (opt = getopt(argc, argv, "m:c:C:xa:")) != -1 ) {
+    if( opt == 'x' ) {
+      check = true;
+      continue;
+    }
+    if( opt == 'a' ) {
+      if( !parse_placement(optarg, &placement) ) {
+        usage(prog);
+      }
+      continue;
+    }
+    if( opt == 'c' ) {
+      cacheFile = optarg;
+      continue;
+    }
+    if( opt == 'C' ) {
+      cacheLimit = strtoull(optarg, 0, 10);
+      continue;
+    }
+    if( opt != 'm' ) {
+      usage(prog);
+    }
+    int m = 0;
+    while( m <= AUTO && strcasecmp(optarg, modeNames[m]) ) {
+      m++;
+    }
+    if( m > AUTO ) {
+      usage(prog);
+    }
+    mode = (Mode)m;
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc != 3 && argc != 4) {
+    usage(prog);
   }
 
 #if 0
@@ -195,23 +1482,78 @@ int main(int argc, char *argv[])
   }
 #endif
   
-  uint4 a = 1;
-  uint4 b = 1000;
+  uint8 a = 1;
+  uint8 b = 1000;
   int   tn = 1;
 
-  a = atoi(argv[1]);
-  b = atoi(argv[2]);
-  tn = atoi(argv[3]);
+  // strtoull rather than atoi: a and b may not fit in an int
+  a = strtoull(argv[1], 0, 10);
+  b = strtoull(argv[2], 0, 10);
+  tn = argc == 4 ? atoi(argv[3]) : default_threads();
 
   assert(a >= 1);
   assert(a <= b);
   assert(tn > 0);
 
-  printf("a=%u b=%d tn=%d\n", a, b, tn);
+  if( cacheFile && (cacheLimit || !open_cache(cacheFile)) ) {
+    if( !cacheLimit ) {
+      cacheLimit = 0xFFFFFFFFULL;
+    }
+    if( isqrt(cacheLimit) > maxSieveRoot ) {
+      printf("the cache limit is too large for the sieve\n");
+      exit(1);
+    }
+    printf("building prime cache %s for [0,%llu]\n", cacheFile, cacheLimit);
+    build_cache(cacheFile, cacheLimit, tn);
+    if( !open_cache(cacheFile) ) {
+      printf("cannot open prime cache %s\n", cacheFile);
+      exit(1);
+    }
+  }
+
+  if( primeCache.covers(b) ) {
+    printf("a=%llu b=%llu mode=cache\n", a, b);
+  } else {
+    if( mode == AUTO ) {
+      mode = choose_mode(a, b);
+    }
+    if( mode == SIEVE && isqrt(b) > maxSieveRoot ) {
+      printf("b is too large for the sieve; use -m mr\n");
+      exit(1);
+    }
+    if( mode == PI && b > maxPi ) {
+      printf("b is too large for pi mode; use -m mr\n");
+      exit(1);
+    }
+    printf("a=%llu b=%llu tn=%d mode=%s\n", a, b, tn, modeNames[mode]);
+  }
 
-  int result = num_primes(a, b, tn);
-  printf("there are %d primes in [%u,%u]\n", result, a, b);
-  printf("largest prime found: %u\n", largestPrime );
+  Summary<uint8> result = any_primes(a, b, tn, mode);
+  printf("there are %llu primes in [%llu,%llu]\n", result.count, a, b);
+  printf("largest prime found: %llu\n", result.last );
+  printf("smallest prime found: %llu\n", result.first );
+  if( mode == PI && !primeCache.covers(b) ) {
+    printf("twin prime pairs and gaps are not counted in pi mode\n");
+  } else {
+    printf("twin prime pairs: %llu\n", result.twins );
+    printf("largest gap between consecutive primes: %llu\n", result.maxGap );
+  }
+
+  if( check ) {
+    // Count again by testing every integer, without the cache
+    Mode other = choose_mode(a, b);
+    primeCache.bits = 0;
+    Summary<uint8> expected = any_primes(a, b, tn, other);
+    bool same = result.count == expected.count && result.first == expected.first &&
+                result.last == expected.last;
+    if( mode != PI ) {
+      same = same && result.twins == expected.twins && result.maxGap == expected.maxGap;
+    }
+    printf("checked against mode=%s: %s\n", modeNames[other], same ? "ok" : "MISMATCH");
+    if( !same ) {
+      return 1;
+    }
+  }
 
   return 0;
 }
@@ -222,7 +1564,10 @@ int main(int argc, char *argv[])
     g++ -O3 -o primes primes.c -lpthread
     
 
-  runtimes and speedup compared to tn=1:
+  (add -m trial to time the trial division version instead of the sieve)
+
+  runtimes and speedup compared to tn=1 (make bench measures these,
+  with repeated runs, in bench.csv; see scaling.c):
 
                             runtime   speedup 
   ./primes 1 50000000 1                  1 
@@ -0,0 +1,273 @@
+// run primes, sum and insertion over a sweep of thread counts, input
+// sizes and modes, and report how their wall time scales
+//
+// compile with (or just run make bench)
+//   g++ -Wall -Wextra -Wconversion -O3 -o scaling scaling.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+typedef unsigned long long uint8;
+
+// One program to sweep: every mode, at every size, with every thread
+// count.  args() turns one point of the sweep into a command line.
+struct Sweep
+{
+  const char *program;
+  std::vector<const char *> modes;
+  std::vector<uint8> sizes;
+};
+
+// The programs are run from the top of the tree, where make builds
+// them.  The sizes are chosen so that one run takes 0.1 to 2 seconds
+// on the lab machines: long enough for the startup to not matter,
+// short enough to repeat.
+//  - primes: count the primes in [1, size]
+//  - sum: 1000 calls of sum() over size doubles
+//  - insertion: sort size random words in total
+const Sweep sweeps[] = {
+  { "primes", { "sieve" }, { 50000000, 500000000 } },
+  { "primes", { "trial", "mr" }, { 10000000 } },
+  { "sum", { "naive", "kahan", "pairwise" }, { 1000000, 4000000 } },
+  { "insertion", { "list", "sharded", "radix", "count", "pipeline" }, { 1000000 } },
+};
+
+std::vector<std::string> args(const char *program, const char *mode, uint8 size, int threads)
+{
+  std::string n = std::to_string(size);
+  std::string tn = std::to_string(threads);
+  if( !strcmp(program, "primes") ) {
+    return { "./primes", "-m", mode, "1", n, tn };
+  }
+  if( !strcmp(program, "sum") ) {
+    return { "lab10/sum", "-m", mode, n, tn };
+  }
+  return { "lab10/insertion", "-m", mode, tn, std::to_string(size / (uint8)threads) };
+}
+
+
+// What we measured for one point of a sweep
+struct Result
+{
+  const char *program;
+  const char *mode;
+  uint8 size;
+  int threads;
+  std::vector<double> times;  // wall time of each run, sorted
+  double median;
+  double p10;
+  double p90;
+  double speedup;     // median with 1 thread / median
+  double efficiency;  // speedup / threads
+};
+
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+// Run the command with its output thrown away, and return its wall
+// time in seconds, or exit if it fails.
+double run(const std::vector<std::string> &command)
+{
+  std::vector<char *> argv;
+  for( const std::string &a : command ) {
+    argv.push_back((char *) a.c_str());
+  }
+  argv.push_back(0);
+
+  double start = now();
+  pid_t pid = fork();
+  if( pid == 0 ) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execv(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status;
+  if( pid < 0 || waitpid(pid, &status, 0) != pid ) {
+    perror("fork");
+    exit(1);
+  }
+  double t = now() - start;
+  if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+    std::string line;
+    for( const std::string &a : command ) {
+      line += " " + a;
+    }
+    fprintf(stderr, "failed:%s\n", line.c_str());
+    exit(1);
+  }
+  return t;
+}
+
+// The p-th percentile of sorted times, by linear interpolation
+// between the closest ranks
+double percentile(const std::vector<double> &times, double p)
+{
+  double rank = p / 100 * (double) (times.size() - 1);
+  size_t i = (size_t) rank;
+  if( i + 1 >= times.size() ) {
+    return times.back();
+  }
+  return times[i] + (rank - (double) i) * (times[i + 1] - times[i]);
+}
+
+
+void write_csv(FILE *f, const std::vector<Result> &results)
+{
+  fprintf(f, "program,mode,size,threads,runs,median_s,p10_s,p90_s,min_s,max_s,speedup,efficiency\n");
+  for( const Result &r : results ) {
+    fprintf(f, "%s,%s,%llu,%d,%zu,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f\n", r.program, r.mode,
+            r.size, r.threads, r.times.size(), r.median, r.p10, r.p90, r.times.front(),
+            r.times.back(), r.speedup, r.efficiency);
+  }
+}
+
+void write_json(FILE *f, const std::vector<Result> &results)
+{
+  fprintf(f, "[\n");
+  for( size_t i = 0; i < results.size(); i++ ) {
+    const Result &r = results[i];
+    fprintf(f, "  { \"program\": \"%s\", \"mode\": \"%s\", \"size\": %llu, \"threads\": %d, "
+            "\"median_s\": %.6f, \"p10_s\": %.6f, \"p90_s\": %.6f, \"speedup\": %.3f, "
+            "\"efficiency\": %.3f, \"times_s\": [", r.program, r.mode, r.size, r.threads,
+            r.median, r.p10, r.p90, r.speedup, r.efficiency);
+    for( size_t k = 0; k < r.times.size(); k++ ) {
+      fprintf(f, "%s%.6f", k ? ", " : "", r.times[k]);
+    }
+    fprintf(f, "] }%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "]\n");
+}
+
+// Write the results to file, or to stdout if file is "-"
+void write_results(const char *file, bool json, const std::vector<Result> &results)
+{
+  FILE *f = strcmp(file, "-") ? fopen(file, "w") : stdout;
+  if( !f ) {
+    perror(file);
+    exit(1);
+  }
+  if( json ) {
+    write_json(f, results);
+  } else {
+    write_csv(f, results);
+  }
+  if( f != stdout ) {
+    fclose(f);
+  }
+}
+
+
+void usage(const char *prog)
+{
+  printf("usage: %s [-r runs] [-w warmup] [-t max-threads] [-p program] [-c file.csv] [-j file.json]\n"
+         "Times primes, sum and insertion with 1, 2, 4, ... threads, in\n"
+         "every mode and at several input sizes, and reports the median,\n"
+         "10th and 90th percentile wall time, speedup and efficiency.\n"
+         "  -r  timed runs of each command (default 5)\n"
+         "  -w  untimed runs before them (default 1)\n"
+         "  -t  most threads to try (default: 8, or the number of CPUs if more)\n"
+         "  -p  only sweep this program\n"
+         "  -c  write CSV to file (default: to stdout, if there is no -j)\n"
+         "  -j  write JSON to file\n", prog);
+  exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int runs = 5;
+  int warmup = 1;
+  int maxThreads = std::max(8, (int) sysconf(_SC_NPROCESSORS_ONLN));
+  const char *only = 0;
+  const char *csv = 0;
+  const char *json = 0;
+  int opt;
+  while( (opt = getopt(argc, argv, "r:w:t:p:c:j:")) != -1 ) {
+    if( opt == 'r' ) {
+      runs = atoi(optarg);
+    } else if( opt == 'w' ) {
+      warmup = atoi(optarg);
+    } else if( opt == 't' ) {
+      maxThreads = atoi(optarg);
+    } else if( opt == 'p' ) {
+      only = optarg;
+    } else if( opt == 'c' ) {
+      csv = optarg;
+    } else if( opt == 'j' ) {
+      json = optarg;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if( optind != argc || runs < 1 || warmup < 0 || maxThreads < 1 ) {
+    usage(argv[0]);
+  }
+  if( !csv && !json ) {
+    csv = "-";
+  }
+
+  std::vector<int> threadCounts;
+  for( int t = 1; t <= maxThreads; t *= 2 ) {
+    threadCounts.push_back(t);
+  }
+  if( threadCounts.back() != maxThreads ) {
+    threadCounts.push_back(maxThreads);
+  }
+
+  std::vector<Result> results;
+  for( const Sweep &sweep : sweeps ) {
+    if( only && strcmp(only, sweep.program) ) {
+      continue;
+    }
+    for( const char *mode : sweep.modes ) {
+      for( uint8 size : sweep.sizes ) {
+        double base = 0;  // median with 1 thread
+        for( int threads : threadCounts ) {
+          std::vector<std::string> command = args(sweep.program, mode, size, threads);
+          Result r = { sweep.program, mode, size, threads, {}, 0, 0, 0, 0, 0 };
+          for( int i = 0; i < warmup; i++ ) {
+            run(command);
+          }
+          for( int i = 0; i < runs; i++ ) {
+            r.times.push_back(run(command));
+          }
+          std::sort(r.times.begin(), r.times.end());
+          r.median = percentile(r.times, 50);
+          r.p10 = percentile(r.times, 10);
+          r.p90 = percentile(r.times, 90);
+          if( threads == 1 ) {
+            base = r.median;
+          }
+          r.speedup = base / r.median;
+          r.efficiency = r.speedup / threads;
+          fprintf(stderr, "%-9s %-8s %10llu %3d threads: %8.3f s  speedup %5.2f\n",
+                  r.program, r.mode, r.size, r.threads, r.median, r.speedup);
+          results.push_back(r);
+        }
+      }
+    }
+  }
+
+  if( csv ) {
+    write_results(csv, false, results);
+  }
+  if( json ) {
+    write_results(json, true, results);
+  }
+  return 0;
+}
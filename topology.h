@@ -0,0 +1,237 @@
+// Which CPUs this machine has, how they share cores, packages and
+// NUMA nodes, and where to put worker threads on them.
+//
+// The speedup of primes and sum depends on more than the number of
+// CPUs the OS reports.  Two SMT threads ("hyperthreads") of one core
+// share its execution units and caches, so a second thread on a core
+// adds much less than a thread on another core.  On a machine with
+// several packages (sockets), each one has its own memory
+// controller: memory attached to the other package (another NUMA
+// node) is slower to reach.
+//
+// read_topology() reads all of this from /sys/devices/system/cpu.
+// default_threads() is the number of physical cores, which is where
+// compute-bound work like primes stops scaling.  placement_order()
+// lists the CPUs in the order workers should take them, and
+// pin_thread() keeps a thread on one.
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <vector>
+
+struct Cpu
+{
+  int id;       // as the OS numbers it (cpuN)
+  int package;  // physical_package_id
+  int core;     // core_id, unique only within a package
+  int node;     // NUMA node
+  int smt;      // 0 for the first CPU of its core, 1 for its sibling, ...
+  int coreRank; // index of its core among the cores of its package
+};
+
+struct Topology
+{
+  std::vector<Cpu> cpus;
+  int cores;    // physical cores, over all packages
+  int nodes;
+};
+
+// How workers are spread over the CPUs.
+//  - UNPINNED: let the OS place them, and move them, as it likes.
+//  - COMPACT: fill both SMT threads of a core, then the next core,
+//    then the next package.  Threads that share data share caches.
+//  - SCATTER: one worker per core, alternating between packages,
+//    before any core gets a second.  Each worker gets a whole core
+//    and as much memory bandwidth as possible.
+enum Placement { UNPINNED, COMPACT, SCATTER };
+const char *const placementNames[] = { "none", "compact", "scatter" };
+
+
+// Read a single integer from a sysfs file, or return fallback
+static inline int read_sysfs_int(const char *path, int fallback)
+{
+  FILE *f = fopen(path, "r");
+  if( !f ) {
+    return fallback;
+  }
+  int v;
+  if( fscanf(f, "%d", &v) != 1 ) {
+    v = fallback;
+  }
+  fclose(f);
+  return v;
+}
+
+// Parse a CPU list like "0-3,8,10-11"
+static inline std::vector<int> parse_cpu_list(const char *list)
+{
+  std::vector<int> ids;
+  const char *p = list;
+  while( *p >= '0' && *p <= '9' ) {
+    char *end;
+    int lo = (int) strtol(p, &end, 10);
+    int hi = lo;
+    if( *end == '-' ) {
+      hi = (int) strtol(end + 1, &end, 10);
+    }
+    for( int i = lo; i <= hi; i++ ) {
+      ids.push_back(i);
+    }
+    p = *end == ',' ? end + 1 : end;
+  }
+  return ids;
+}
+
+static inline Topology read_topology()
+{
+  Topology t;
+  std::vector<int> ids;
+  FILE *f = fopen("/sys/devices/system/cpu/online", "r");
+  if( f ) {
+    char line[4096];
+    if( fgets(line, sizeof(line), f) ) {
+      ids = parse_cpu_list(line);
+    }
+    fclose(f);
+  }
+  if( ids.empty() ) {
+    // No sysfs: every CPU is its own core, on node 0
+    for( int i = 0; i < (int) sysconf(_SC_NPROCESSORS_ONLN); i++ ) {
+      ids.push_back(i);
+    }
+  }
+
+  for( int id : ids ) {
+    char path[256];
+    Cpu c = { id, 0, id, 0, 0, 0 };
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", id);
+    c.package = std::max(0, read_sysfs_int(path, 0));
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", id);
+    c.core = read_sysfs_int(path, id);
+    // The node is only given as a nodeN entry in the CPU's directory
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", id);
+    DIR *dir = opendir(path);
+    if( dir ) {
+      while( struct dirent *e = readdir(dir) ) {
+        if( !strncmp(e->d_name, "node", 4) && e->d_name[4] >= '0' && e->d_name[4] <= '9' ) {
+          c.node = atoi(e->d_name + 4);
+        }
+      }
+      closedir(dir);
+    }
+    t.cpus.push_back(c);
+  }
+
+  // Number the SMT siblings of each core, and the cores of each
+  // package, in order of their ids
+  std::sort(t.cpus.begin(), t.cpus.end(), [](const Cpu &x, const Cpu &y) {
+    return x.package != y.package ? x.package < y.package :
+           x.core != y.core ? x.core < y.core : x.id < y.id;
+  });
+  t.cores = 0;
+  t.nodes = 0;
+  for( size_t i = 0; i < t.cpus.size(); i++ ) {
+    Cpu &c = t.cpus[i];
+    const Cpu *prev = i ? &t.cpus[i - 1] : 0;
+    bool samePackage = prev && prev->package == c.package;
+    bool sameCore = samePackage && prev->core == c.core;
+    c.smt = sameCore ? prev->smt + 1 : 0;
+    c.coreRank = sameCore ? prev->coreRank : samePackage ? prev->coreRank + 1 : 0;
+    t.cores += !sameCore;
+    t.nodes = std::max(t.nodes, c.node + 1);
+  }
+  return t;
+}
+
+// The topology of this machine, read on first use
+static inline const Topology &topology()
+{
+  static Topology t = read_topology();
+  return t;
+}
+
+// One thread per physical core
+static inline int default_threads()
+{
+  return std::max(1, topology().cores);
+}
+
+// The CPU ids in the order workers should be put on them.  Worker i
+// goes on order[i % order.size()].
+static inline std::vector<int> placement_order(Placement placement)
+{
+  std::vector<Cpu> cpus = topology().cpus;
+  if( placement == SCATTER ) {
+    std::stable_sort(cpus.begin(), cpus.end(), [](const Cpu &x, const Cpu &y) {
+      return x.smt != y.smt ? x.smt < y.smt :
+             x.coreRank != y.coreRank ? x.coreRank < y.coreRank : x.package < y.package;
+    });
+  }
+  // COMPACT is the order read_topology() sorted them in
+  std::vector<int> order;
+  for( const Cpu &c : cpus ) {
+    order.push_back(c.id);
+  }
+  return order;
+}
+
+// The NUMA node of a CPU id (0 if unknown)
+static inline int cpu_node(int id)
+{
+  for( const Cpu &c : topology().cpus ) {
+    if( c.id == id ) {
+      return c.node;
+    }
+  }
+  return 0;
+}
+
+// The NUMA node that holds the page of address p, or -1 if the page
+// is not there yet (never touched) or the kernel has no NUMA.  This
+// is move_pages() asked to move nothing, which only reports where
+// each page is.
+static inline int page_node(const void *p)
+{
+  long pageSize = sysconf(_SC_PAGESIZE);
+  void *page = (void *) ((unsigned long) p & ~(unsigned long) (pageSize - 1));
+  int status = -1;
+  if( syscall(SYS_move_pages, 0, 1UL, &page, (const int *) 0, &status, 0) != 0 ) {
+    return -1;
+  }
+  return status >= 0 ? status : -1;
+}
+
+// Keep thread on the given CPU.  Returns false if the OS refused
+// (e.g. the CPU is not in this process's affinity mask).
+static inline bool pin_thread(pthread_t thread, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+// Parse a Placement name (for -a), or return false
+static inline bool parse_placement(const char *name, Placement *placement)
+{
+  for( int p = UNPINNED; p <= SCATTER; p++ ) {
+    if( !strcasecmp(name, placementNames[p]) ) {
+      *placement = (Placement) p;
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif